@@ -0,0 +1,1116 @@
+// Offline benchmark for the GrainDelay kernels and the full unit.
+// Runs without a server: a mock interface table and World drive the plugin
+// through the same entry points scsynth uses, and report ns per sample.
+// The render and compare modes write fixed scenarios to reference files and
+// check later builds against them, the check mode compares a summary of them
+// with the one committed next to this file.
+#include "SC_PlugIn.h"
+#include "Utils.hpp"
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdarg>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <vector>
+
+extern "C" void load(InterfaceTable* inTable);
+
+namespace {
+
+// ===== MOCK SERVER =====
+
+struct UnitEntry {
+    std::string name;
+    size_t allocSize = 0;
+    UnitCtorFunc ctor = nullptr;
+    UnitDtorFunc dtor = nullptr;
+};
+
+struct UnitCommand {
+    std::string unitName;
+    std::string name;
+    UnitCmdFunc func = nullptr;
+};
+
+std::vector<UnitEntry> s_units;
+std::vector<UnitCommand> s_commands;
+std::vector<float> s_lastReply; // Values of the last node reply
+
+int mockPrint(const char* fmt, ...) {
+    va_list args;
+    va_start(args, fmt);
+    const int result = std::vfprintf(stderr, fmt, args);
+    va_end(args);
+    return result;
+}
+
+void* mockAlloc(World*, size_t size) {
+    return std::malloc(size);
+}
+
+void mockFree(World*, void* ptr) {
+    std::free(ptr);
+}
+
+bool mockDefineUnit(const char* name, size_t allocSize, UnitCtorFunc ctor, UnitDtorFunc dtor, uint32) {
+    s_units.push_back(UnitEntry{name, allocSize, ctor, dtor});
+    return true;
+}
+
+bool mockDefineUnitCmd(const char* unitName, const char* name, UnitCmdFunc func) {
+    s_commands.push_back(UnitCommand{unitName, name, func});
+    return true;
+}
+
+void mockSendNodeReply(Node*, int, const char*, int numArgs, const float* values) {
+    s_lastReply.assign(values, values + numArgs);
+}
+
+// Runs the stages at once, as if the non-realtime thread were always idle
+int mockAsynchronousCommand(World* world, void*, const char*, void* data, AsyncStageFn stage2, AsyncStageFn stage3,
+                            AsyncStageFn stage4, AsyncFreeFn cleanup, int, void*) {
+    if ((stage2 == nullptr || stage2(world, data)) && (stage3 == nullptr || stage3(world, data)) && stage4 != nullptr) {
+        stage4(world, data);
+    }
+    if (cleanup != nullptr) {
+        cleanup(world, data);
+    }
+    return 0;
+}
+
+void mockClearUnitOutputs(Unit* unit, int numSamples) {
+    for (uint32 i = 0; i < unit->mNumOutputs; ++i) {
+        std::memset(unit->mOutBuf[i], 0, numSamples * sizeof(float));
+    }
+}
+
+const UnitEntry* findUnit(const char* name) {
+    for (const UnitEntry& entry : s_units) {
+        if (entry.name == name) {
+            return &entry;
+        }
+    }
+    return nullptr;
+}
+
+UnitCmdFunc findCommand(const std::string& unitName, const char* name) {
+    for (const UnitCommand& command : s_commands) {
+        if (command.unitName == unitName && command.name == name) {
+            return command.func;
+        }
+    }
+    return nullptr;
+}
+
+// ===== TIMING =====
+
+using Clock = std::chrono::steady_clock;
+
+double nanosecondsPer(Clock::time_point start, Clock::time_point end, double count) {
+    return std::chrono::duration<double, std::nano>(end - start).count() / count;
+}
+
+// Keeps results alive so the optimizer can't drop the measured loops
+volatile float s_sink = 0.0f;
+
+// ===== UNIT BENCHMARK =====
+
+// Inputs in the order of GrainDelay.sc, modulatable ones as control-rate wires.
+// With lanes > 0 the same values feed every lane of a GrainDelayBank.
+struct UnitParams {
+    float triggerRate = 10.0f;
+    float overlap = 1.0f;
+    float delayTime = 0.2f;
+    float grainRate = 1.0f;
+    float mix = 0.5f;
+    float feedback = 0.3f;
+    float damping = 0.7f;
+    float maxDelayTime = 5.0f;
+    float windowType = 0.0f;
+    float maxGrains = 32.0f;
+    float stealMode = 0.0f;
+    float interpolation = 2.0f;
+    float delayJitter = 0.0f;
+    float rateJitter = 0.0f;
+    float lineFormat = 0.0f;
+    float longDelay = 0.0f;
+    float triggerRateStep = 0.0f; // Trigger rate from stepSeconds on, 0 keeps triggerRate
+    double stepSeconds = 1.0;
+    bool audioRate = false;   // Modulatable inputs at audio rate
+    bool silentInput = false; // Silent input into a silent delay line, the unit idles
+    double silentSeconds = 0.0; // Silent input for this long before the test signal starts
+    int lanes = 0;            // Lanes of a GrainDelayBank, 0 for the GrainDelay inputs
+    int blockSize = 64;
+    double sampleRate = 48000.0;
+};
+
+class MockUnit {
+public:
+    MockUnit(const UnitEntry& entry, const UnitParams& params, int numOutputs) :
+        m_entry(entry),
+        m_params(params)
+    {
+        const int block = params.blockSize;
+        const double sr = params.sampleRate;
+
+        m_world.mSampleRate = sr;
+        m_world.mBufLength = block;
+        m_world.mFullRate = Rate{sr, 1.0 / sr, block / sr, sr / block, 1.0 / block, 2.0 * 3.14159265358979 / sr, block, 0, 0, 0.0};
+        m_world.mBufRate = Rate{sr / block, block / sr, 1.0, 1.0, 1.0, 2.0 * 3.14159265358979 * block / sr, 1, 0, 0, 0.0};
+        m_rate = m_world.mFullRate;
+        m_rgen.init(1234);
+        m_graph.mRGen = &m_rgen;
+
+        std::vector<float> values;
+
+        if (params.lanes == 0) {
+            values = {
+                0.0f, params.triggerRate, params.overlap, params.delayTime, params.grainRate,
+                params.mix, params.feedback, params.damping, 0.0f, 0.0f,
+                params.maxDelayTime, params.windowType, 0.0f, 1.0f, -1.0f, 0.0f, params.maxGrains,
+                params.stealMode, params.interpolation, params.delayJitter, params.rateJitter,
+                params.lineFormat, params.longDelay
+            };
+            m_signalInputs.push_back(0);
+        } else {
+            // Shared inputs of GrainDelayBank.sc, then input, triggerRate, delayTime and grainRate per lane
+            values = {
+                params.overlap, params.mix, params.feedback, params.damping, 0.0f, 0.0f,
+                params.maxDelayTime, params.windowType, params.maxGrains, params.interpolation,
+                params.delayJitter, params.rateJitter
+            };
+            for (int k = 0; k < params.lanes; ++k) {
+                m_signalInputs.push_back(static_cast<int>(values.size()));
+                values.insert(values.end(), {0.0f, params.triggerRate, params.delayTime, params.grainRate});
+            }
+        }
+        const int numInputs = static_cast<int>(values.size());
+
+        m_inputs.assign(numInputs, std::vector<float>(block));
+        m_wires.resize(numInputs);
+
+        for (int i = 0; i < numInputs; ++i) {
+            std::fill(m_inputs[i].begin(), m_inputs[i].end(), values[i]);
+            const bool signal = std::find(m_signalInputs.begin(), m_signalInputs.end(), i) != m_signalInputs.end();
+            const bool modulatable = params.lanes == 0 && i >= 1 && i <= 4;
+            m_wires[i].mCalcRate = (signal || (modulatable && params.audioRate)) ? calc_FullRate : calc_BufRate;
+            m_wires[i].mBuffer = m_inputs[i].data();
+            m_wirePtrs.push_back(&m_wires[i]);
+            m_inPtrs.push_back(m_inputs[i].data());
+        }
+
+        m_outputs.assign(numOutputs, std::vector<float>(block));
+        for (std::vector<float>& output : m_outputs) {
+            m_outPtrs.push_back(output.data());
+        }
+
+        m_unit = static_cast<Unit*>(std::calloc(1, entry.allocSize));
+        m_unit->mWorld = &m_world;
+        m_unit->mParent = &m_graph;
+        m_unit->mNumInputs = numInputs;
+        m_unit->mNumOutputs = numOutputs;
+        m_unit->mCalcRate = calc_FullRate;
+        m_unit->mInput = m_wirePtrs.data();
+        m_unit->mRate = &m_rate;
+        m_unit->mInBuf = m_inPtrs.data();
+        m_unit->mOutBuf = m_outPtrs.data();
+        m_unit->mBufLength = block;
+
+        fillInput(0);
+        (entry.ctor)(m_unit);
+    }
+
+    ~MockUnit() {
+        (m_entry.dtor)(m_unit);
+        std::free(m_unit);
+    }
+
+    // Renders the given number of samples, returns ns per sample
+    double run(int numSamples) {
+        const int block = m_params.blockSize;
+        double elapsed = 0.0;
+
+        for (int pos = 0; pos < numSamples; pos += block) {
+            fillInput(pos);
+            const Clock::time_point start = Clock::now();
+            (m_unit->mCalcFunc)(m_unit, block);
+            elapsed += nanosecondsPer(start, Clock::now(), 1.0);
+            s_sink = s_sink + m_outputs[0][0];
+        }
+
+        return elapsed / numSamples;
+    }
+
+    // Renders the given number of samples and appends them to frames, outputs interleaved.
+    // Units with a "stats" command also append the grains started in each block and the
+    // grains active at its end to grains, as the unit counts them.
+    void render(int numSamples, std::vector<float>& frames, std::vector<int>& grains) {
+        const int block = m_params.blockSize;
+        const UnitCmdFunc stats = findCommand(m_entry.name, "stats");
+
+        for (int pos = 0; pos < numSamples; pos += block) {
+            fillInput(pos);
+            (m_unit->mCalcFunc)(m_unit, block);
+
+            for (int i = 0; i < block; ++i) {
+                for (const std::vector<float>& output : m_outputs) {
+                    frames.push_back(output[i]);
+                }
+            }
+
+            if (stats != nullptr) {
+                sc_msg_iter args;
+                s_lastReply.clear();
+                (stats)(m_unit, &args);
+
+                // active, dropped, peak, grains per second since the last query, ...
+                if (s_lastReply.size() >= 4) {
+                    const double started = static_cast<double>(s_lastReply[3]) * block / m_params.sampleRate;
+                    grains.push_back(static_cast<int>(std::lround(started)));
+                    grains.push_back(static_cast<int>(s_lastReply[0]));
+                }
+            }
+        }
+    }
+
+private:
+    // Test signal: two detuned sines, gated so the delay line sees silence too.
+    // Every lane of a bank gets the same signal.
+    void fillInput(int pos) {
+        std::vector<float>& input = m_inputs[m_signalInputs[0]];
+        const int silent = static_cast<int>(m_params.silentSeconds * m_params.sampleRate);
+
+        if (m_params.silentInput) {
+            std::fill(input.begin(), input.end(), 0.0f);
+        } else {
+            for (int i = 0; i < m_params.blockSize; ++i) {
+                const int t = pos + i;
+                input[i] = t < silent ? 0.0f : 0.5f * std::sin(t * 0.031f) + 0.3f * std::sin(t * 0.0071f) * ((t / 3000) % 2);
+            }
+        }
+
+        for (size_t k = 1; k < m_signalInputs.size(); ++k) {
+            m_inputs[m_signalInputs[k]] = input;
+        }
+
+        if (m_params.triggerRateStep != 0.0f && m_params.lanes == 0 && pos >= m_params.stepSeconds * m_params.sampleRate) {
+            std::fill(m_inputs[1].begin(), m_inputs[1].end(), m_params.triggerRateStep);
+        }
+    }
+
+    const UnitEntry& m_entry;
+    const UnitParams m_params;
+    World m_world{};
+    Rate m_rate{};
+    Graph m_graph{};
+    RGen m_rgen{};
+    std::vector<std::vector<float>> m_inputs;
+    std::vector<int> m_signalInputs;   // Audio inputs fed with the test signal
+    std::vector<Wire> m_wires;
+    std::vector<Wire*> m_wirePtrs;
+    std::vector<float*> m_inPtrs;
+    std::vector<std::vector<float>> m_outputs;
+    std::vector<float*> m_outPtrs;
+    Unit* m_unit = nullptr;
+};
+
+double benchUnit(const char* name, const UnitParams& params, double seconds, int numOutputs = 1) {
+    const UnitEntry* entry = findUnit(name);
+
+    if (entry == nullptr) {
+        std::fprintf(stderr, "unit %s not registered\n", name);
+        std::exit(1);
+    }
+
+    MockUnit unit(*entry, params, numOutputs);
+    const int numSamples = static_cast<int>(seconds * params.sampleRate);
+
+    // One second of warm-up fills the delay line and the voice pool
+    unit.run(static_cast<int>(params.sampleRate));
+    return unit.run(numSamples);
+}
+
+void printUnitRow(const char* label, float value, const UnitParams& params, double seconds, const char* name = "GrainDelay", int numOutputs = 1) {
+    std::printf("  %-14s %10g  %8.2f ns/sample\n", label, value, benchUnit(name, params, seconds, numOutputs));
+}
+
+// ===== KERNEL BENCHMARKS =====
+
+constexpr int KERNEL_SAMPLES = 1 << 22;
+
+void benchKernels() {
+    std::printf("kernels (ns per call)\n");
+
+    // Trigger ramp and voice bookkeeping, reference per-sample path
+    {
+        Utils::EventSystem<32> eventSystem;
+        std::vector<float> phases(32);
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            eventSystem.process(400.0f, false, 8.0f, 48000.0f, phases.data());
+        }
+
+        std::printf("  %-34s %8.2f\n", "EventSystem::process (8 voices)", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + phases[0];
+    }
+
+    // Block path: trigger ramp only
+    {
+        Utils::EventSystem<32> eventSystem;
+        int triggers = 0;
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            triggers += eventSystem.advance(400.0f, 48000.0f);
+        }
+
+        std::printf("  %-34s %8.2f\n", "EventSystem::advance", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + static_cast<float>(triggers);
+    }
+
+    // Trigger search over 64-sample blocks, as the unit runs it
+    {
+        Utils::EventSystem<32> eventSystem;
+        const Utils::ParamSignal rate{nullptr, 400.0f, 0.0f, 400.0f, 400.0f};
+        int triggers = 0;
+        const Clock::time_point start = Clock::now();
+
+        for (int block = 0; block < KERNEL_SAMPLES; block += 64) {
+            for (int i = eventSystem.nextTrigger<Utils::ParamRates::Control>(rate, 48000.0f, 0, 64); i < 64;
+                 i = eventSystem.nextTrigger<Utils::ParamRates::Control>(rate, 48000.0f, i + 1, 64)) {
+                ++triggers;
+            }
+        }
+
+        std::printf("  %-34s %8.2f\n", "EventSystem::nextTrigger (blocks)", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + static_cast<float>(triggers);
+    }
+
+    // Window phase of a 20 s grain in the build's precision against double accumulation,
+    // reported as the largest timing error in samples
+    {
+        Utils::EventSystem<1> eventSystem;
+        eventSystem.triggerSlope = 0.05 / 48000.0;
+        eventSystem.triggerOffset = 0.37;
+        eventSystem.restartChannel(0, 1.0f);
+        double reference = eventSystem.triggerSlope * eventSystem.triggerOffset;
+        double maxError = 0.0;
+        int length = 0;
+
+        while (reference < 1.0) {
+            maxError = std::max(maxError, std::abs(eventSystem.channelPhases[0] - reference) / eventSystem.triggerSlope);
+            eventSystem.advanceChannel(0, 1);
+            reference += eventSystem.triggerSlope;
+            ++length;
+        }
+
+        std::printf("  %-34s %8.4f samples over %d\n", "window phase error", maxError, length);
+    }
+
+    // Delay line reads at a moving fractional position
+    constexpr int bufSize = 1 << 18;
+    std::vector<float> memory(Utils::RingBuffer::allocationSize(bufSize));
+    Utils::RingBuffer buffer;
+    buffer.init(memory.data(), bufSize);
+
+    for (int i = 0; i < bufSize; ++i) {
+        buffer.write(i, std::sin(i * 0.01f));
+    }
+
+    {
+        float sum = 0.0f;
+        float phase = 0.0f;
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            sum += Utils::peekCubicInterp(buffer, phase);
+            phase += 1.37f;
+            phase = phase >= bufSize ? phase - bufSize : phase;
+        }
+
+        std::printf("  %-34s %8.2f\n", "peekCubicInterp (ring buffer)", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + sum;
+    }
+
+    {
+        float sum = 0.0f;
+        float phase = 0.0f;
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            sum += Utils::peekCubicInterp(memory.data(), bufSize, phase);
+            phase += 1.37f;
+            phase = phase >= bufSize ? phase - bufSize : phase;
+        }
+
+        std::printf("  %-34s %8.2f\n", "peekCubicInterp (wrapping)", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + sum;
+    }
+
+    // Windowed interpolation kernel over 64-sample chunks
+    {
+        constexpr int chunk = 64;
+        float phases[chunk];
+        float window[chunk];
+        float accum[chunk] = {};
+
+        for (int i = 0; i < chunk; ++i) {
+            phases[i] = 1000.0f + i * 1.37f;
+            window[i] = Utils::hanningWindow(i / static_cast<float>(chunk));
+        }
+
+        const int iterations = KERNEL_SAMPLES / chunk;
+        const Clock::time_point start = Clock::now();
+
+        for (int n = 0; n < iterations; ++n) {
+            Utils::accumulateCubicWindowed(buffer, phases, window, accum, chunk);
+            phases[n & (chunk - 1)] += 0.001f;
+        }
+
+        std::printf("  %-34s %8.2f\n", "accumulateCubicWindowed (per sample)", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + accum[0];
+    }
+
+    // Windows: direct evaluation against the shared table
+    {
+        float sum = 0.0f;
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            sum += Utils::hanningWindow(static_cast<float>(i & 4095) / 4096.0f);
+        }
+
+        std::printf("  %-34s %8.2f\n", "hanningWindow", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + sum;
+    }
+
+    {
+        Utils::WindowTable table;
+        table.fill(Utils::WindowShape::Hann);
+        float sum = 0.0f;
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            sum += table.lookup(static_cast<float>(i & 4095) / 4096.0f);
+        }
+
+        std::printf("  %-34s %8.2f\n", "WindowTable::lookup", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + sum;
+    }
+
+    // Feedback path filters
+    {
+        Utils::OnePoleNormalized damping;
+        Utils::OnePoleFilter dcBlocker;
+        damping.setCoefficient(0.7f);
+        dcBlocker.setCutoff(3.0f, 48000.0f);
+        float sum = 0.0f;
+        const Clock::time_point start = Clock::now();
+
+        for (int i = 0; i < KERNEL_SAMPLES; ++i) {
+            const float x = static_cast<float>(i & 255) * 0.004f - 0.5f;
+            sum += damping.processLowpass(x) + dcBlocker.processHighpass(x);
+        }
+
+        std::printf("  %-34s %8.2f\n", "OnePole lowpass + highpass", nanosecondsPer(start, Clock::now(), KERNEL_SAMPLES));
+        s_sink = s_sink + sum;
+    }
+}
+
+// ===== PARAMETER SWEEPS =====
+
+void benchSweeps(double seconds) {
+    const UnitParams base;
+
+    std::printf("\nGrainDelay, one parameter varied from the defaults\n");
+    std::printf("  %-14s %10s  %8.2f ns/sample\n", "defaults", "-", benchUnit("GrainDelay", base, seconds));
+
+    for (float value : {1.0f, 10.0f, 100.0f, 1000.0f}) {
+        UnitParams params = base;
+        params.triggerRate = value;
+        params.overlap = std::min(value * 0.1f, 8.0f);
+        printUnitRow("triggerRate", value, params, seconds);
+    }
+
+    for (float value : {1.0f, 4.0f, 16.0f, 32.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 200.0f;
+        params.overlap = value;
+        printUnitRow("overlap", value, params, seconds);
+    }
+
+    for (float value : {0.5f, 1.0f, 2.0f, 4.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.grainRate = value;
+        printUnitRow("grainRate", value, params, seconds);
+    }
+
+    for (int value : {1, 16, 64, 256, 1024}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.blockSize = value;
+        printUnitRow("blockSize", static_cast<float>(value), params, seconds);
+    }
+
+    for (double value : {44100.0, 48000.0, 96000.0, 192000.0}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.sampleRate = value;
+        printUnitRow("sampleRate", static_cast<float>(value), params, seconds);
+    }
+
+    for (float value : {4.0f, 8.0f, 16.0f, 32.0f, 64.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 400.0f;
+        params.overlap = 64.0f;
+        params.maxGrains = value;
+        printUnitRow("maxGrains", value, params, seconds);
+    }
+
+    for (float value : {0.0f, 1.0f, 2.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 400.0f;
+        params.overlap = 32.0f;
+        params.maxGrains = 16.0f;
+        params.stealMode = value;
+        printUnitRow("stealMode", value, params, seconds);
+    }
+
+    for (float value : {0.0f, 1.0f, 2.0f, 3.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.grainRate = 1.5f;
+        params.interpolation = value;
+        printUnitRow("interpolation", value, params, seconds);
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.audioRate = true;
+        printUnitRow("audio-rate", 1.0f, params, seconds);
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.delayJitter = 0.5f;
+        params.rateJitter = 0.5f;
+        printUnitRow("jitter", 0.5f, params, seconds);
+    }
+
+    // Scattered reads over a 10 second line at 96 kHz, far more than fits into the caches
+    for (float value : {0.0f, 1.0f, 2.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.maxDelayTime = 10.0f;
+        params.delayTime = 5.0f;
+        params.delayJitter = 1.0f;
+        params.sampleRate = 96000.0;
+        params.lineFormat = value;
+        printUnitRow("lineFormat", value, params, seconds);
+    }
+
+    // The same line streamed through a long delay line, transfers included
+    for (float value : {0.0f, 1.0f}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.maxDelayTime = 10.0f;
+        params.delayTime = 5.0f;
+        params.delayJitter = 1.0f;
+        params.sampleRate = 96000.0;
+        params.longDelay = value;
+        printUnitRow("longDelay", value, params, seconds);
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.silentInput = true;
+        printUnitRow("idle", 1.0f, params, seconds);
+    }
+
+    for (int value : {2, 4, 8}) {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        printUnitRow("GrainDelayPan", static_cast<float>(value), params, seconds, "GrainDelayPan", value);
+    }
+
+    // A bank lane against a GrainDelay with the same settings. The single unit runs with
+    // its state in cache, so a server full of separate nodes does worse than this row.
+    UnitParams laneParams = base;
+    laneParams.triggerRate = 100.0f;
+    laneParams.overlap = 8.0f;
+    laneParams.maxDelayTime = 1.0f;
+    laneParams.maxGrains = 16.0f;
+
+    std::printf("\nGrainDelayBank, ns/sample per lane\n");
+    printUnitRow("GrainDelay", 1.0f, laneParams, seconds);
+
+    for (int value : {1, 8, 64, 256}) {
+        UnitParams params = laneParams;
+        params.lanes = value;
+        const double perLane = benchUnit("GrainDelayBank", params, seconds, value) / value;
+        std::printf("  %-14s %10d  %8.2f ns/sample\n", "lanes", value, perLane);
+    }
+}
+
+// ===== REFERENCE RENDERS =====
+
+// Fixed scenarios rendered from a fresh unit. The input signal, parameters and the
+// RGen seed are fixed, so a build renders the same samples on every run.
+struct RenderScenario {
+    const char* name;
+    const char* unitName;
+    int numOutputs;
+    UnitParams params;
+};
+
+constexpr double RENDER_SECONDS = 2.0;
+
+// The committed summary: per window of SUMMARY_WINDOW samples the grains started, the
+// grains active at its end and the RMS of each output, which may differ by
+// SUMMARY_TOLERANCE of the reference between compilers and instruction sets
+constexpr int SUMMARY_WINDOW = 4096;
+constexpr double SUMMARY_TOLERANCE = 1e-3;
+
+std::vector<RenderScenario> renderScenarios() {
+    const UnitParams base;
+    std::vector<RenderScenario> scenarios;
+    scenarios.push_back({"defaults", "GrainDelay", 1, base});
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 97.3f;
+        params.overlap = 7.5f;
+        params.delayTime = 0.013f;
+        params.grainRate = 1.5f;
+        params.feedback = 0.6f;
+        scenarios.push_back({"pitched", "GrainDelay", 1, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 400.0f;
+        params.overlap = 16.0f;
+        params.grainRate = 0.7f;
+        params.feedback = 0.9f;
+        params.damping = 0.2f;
+        scenarios.push_back({"dense", "GrainDelay", 1, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 1000.0f;
+        params.overlap = 2.0f;
+        params.delayTime = 0.001f;
+        params.grainRate = 4.0f;
+        params.blockSize = 1;
+        scenarios.push_back({"block1", "GrainDelay", 1, params});
+    }
+
+    const char* const interpNames[] = {"interp0", "interp1", "interp2", "interp3"};
+
+    for (int mode = 0; mode < 4; ++mode) {
+        UnitParams params = base;
+        params.triggerRate = 50.0f;
+        params.overlap = 4.0f;
+        params.grainRate = 1.37f;
+        params.interpolation = static_cast<float>(mode);
+        scenarios.push_back({interpNames[mode], "GrainDelay", 1, params});
+    }
+
+    const char* const windowNames[] = {"window1", "window2", "window3"};
+
+    for (int shape = 1; shape < 4; ++shape) {
+        UnitParams params = base;
+        params.triggerRate = 30.0f;
+        params.overlap = 3.0f;
+        params.windowType = static_cast<float>(shape);
+        scenarios.push_back({windowNames[shape - 1], "GrainDelay", 1, params});
+    }
+
+    const char* const stealNames[] = {"steal1", "steal2"};
+
+    for (int mode = 1; mode < 3; ++mode) {
+        UnitParams params = base;
+        params.triggerRate = 400.0f;
+        params.overlap = 32.0f;
+        params.maxGrains = 8.0f;
+        params.stealMode = static_cast<float>(mode);
+        scenarios.push_back({stealNames[mode - 1], "GrainDelay", 1, params});
+    }
+
+    // After the jump to a dense trigger rate every trigger steals, and new fade tails start
+    // while older ones finish, so several are alive at once
+    const char* const tailNames[] = {"tails4", "tails8", "tails16"};
+
+    for (int k = 0; k < 3; ++k) {
+        UnitParams params = base;
+        params.triggerRate = 20.0f;
+        params.triggerRateStep = 1300.0f;
+        params.overlap = 16.0f;
+        params.maxGrains = static_cast<float>(4 << k);
+        params.stealMode = 1.0f;
+        params.mix = 1.0f;
+        params.feedback = 0.0f;
+        scenarios.push_back({tailNames[k], "GrainDelay", 1, params});
+    }
+
+    // The unit idles through the silent start, grains started there read the input once it arrives
+    {
+        UnitParams params = base;
+        params.overlap = 8.0f;
+        params.delayTime = 0.05f;
+        params.mix = 1.0f;
+        params.silentSeconds = 0.5;
+        scenarios.push_back({"silentstart", "GrainDelay", 1, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.audioRate = true;
+        scenarios.push_back({"audiorate", "GrainDelay", 1, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        scenarios.push_back({"pan4", "GrainDelayPan", 4, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 60.0f;
+        params.overlap = 4.0f;
+        params.delayJitter = 0.5f;
+        params.rateJitter = 0.5f;
+        scenarios.push_back({"jitter", "GrainDelayPan", 2, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.triggerRate = 100.0f;
+        params.overlap = 8.0f;
+        params.maxDelayTime = 1.0f;
+        params.lanes = 10;
+        scenarios.push_back({"bank10", "GrainDelayBank", 10, params});
+    }
+
+    {
+        UnitParams params = base;
+        params.overlap = 8.0f;
+        params.delayTime = 0.05f;
+        params.mix = 1.0f;
+        params.maxDelayTime = 1.0f;
+        params.silentSeconds = 0.5;
+        params.lanes = 4;
+        scenarios.push_back({"banksilent", "GrainDelayBank", 4, params});
+    }
+
+    return scenarios;
+}
+
+// Output frames of a scenario and the unit's grain counts per block, see MockUnit::render
+struct ScenarioRender {
+    std::vector<float> frames;
+    std::vector<int> grains;
+};
+
+ScenarioRender renderScenario(const RenderScenario& scenario) {
+    MockUnit unit(*findUnit(scenario.unitName), scenario.params, scenario.numOutputs);
+    ScenarioRender result;
+    unit.render(static_cast<int>(RENDER_SECONDS * scenario.params.sampleRate), result.frames, result.grains);
+    return result;
+}
+
+std::string referencePath(const std::string& dir, const char* name, const char* extension) {
+    return dir + "/" + name + extension;
+}
+
+bool writeReference(const std::string& dir, const RenderScenario& scenario) {
+    const ScenarioRender render = renderScenario(scenario);
+    std::FILE* audio = std::fopen(referencePath(dir, scenario.name, ".f32").c_str(), "wb");
+    std::FILE* text = std::fopen(referencePath(dir, scenario.name, ".grains").c_str(), "w");
+    const bool opened = audio != nullptr && text != nullptr;
+
+    if (opened) {
+        std::fwrite(render.frames.data(), sizeof(float), render.frames.size(), audio);
+        for (size_t i = 0; i + 1 < render.grains.size(); i += 2) {
+            std::fprintf(text, "%d %d\n", render.grains[i], render.grains[i + 1]);
+        }
+    }
+    if (audio != nullptr) {
+        std::fclose(audio);
+    }
+    if (text != nullptr) {
+        std::fclose(text);
+    }
+    return opened;
+}
+
+// Compares a fresh render against the reference files, prints one row per scenario
+bool compareReference(const std::string& dir, const RenderScenario& scenario, float tolerance) {
+    const ScenarioRender render = renderScenario(scenario);
+    const std::vector<float>& frames = render.frames;
+    std::vector<float> reference(frames.size());
+    std::vector<int> referenceGrains;
+
+    std::FILE* audio = std::fopen(referencePath(dir, scenario.name, ".f32").c_str(), "rb");
+    std::FILE* text = std::fopen(referencePath(dir, scenario.name, ".grains").c_str(), "r");
+
+    if (audio == nullptr || text == nullptr) {
+        std::printf("  %-12s missing reference\n", scenario.name);
+        if (audio != nullptr) {
+            std::fclose(audio);
+        }
+        if (text != nullptr) {
+            std::fclose(text);
+        }
+        return false;
+    }
+
+    const size_t numRead = std::fread(reference.data(), sizeof(float), reference.size(), audio);
+    const bool sameLength = numRead == reference.size() && std::fgetc(audio) == EOF;
+    int count = 0;
+
+    while (std::fscanf(text, "%d", &count) == 1) {
+        referenceGrains.push_back(count);
+    }
+    std::fclose(audio);
+    std::fclose(text);
+
+    float maxDiff = 0.0f;
+
+    // A NaN difference sticks, so it fails the tolerance check below
+    for (size_t i = 0; i < numRead; ++i) {
+        const float diff = std::abs(frames[i] - reference[i]);
+        if (diff > maxDiff || diff != diff) {
+            maxDiff = diff;
+        }
+    }
+
+    // Blocks where the unit started or held a different number of grains
+    const bool sameBlockCount = render.grains.size() == referenceGrains.size();
+    int blocksDiffering = 0;
+
+    for (size_t i = 0; sameBlockCount && i + 1 < render.grains.size(); i += 2) {
+        if (render.grains[i] != referenceGrains[i] || render.grains[i + 1] != referenceGrains[i + 1]) {
+            ++blocksDiffering;
+        }
+    }
+
+    const bool audioPassed = sameLength && maxDiff <= tolerance;
+    const bool grainsPassed = sameBlockCount && blocksDiffering == 0;
+    std::printf("  %-12s max diff %-12g grain counts differ in %d blocks  %s\n", scenario.name, maxDiff, blocksDiffering,
+        audioPassed && grainsPassed ? "ok" : (sameLength && sameBlockCount ? "FAILED" : "FAILED (length differs)"));
+    return audioPassed && grainsPassed;
+}
+
+// One summary row per window: grains started, grains active at its end and the RMS of each
+// output. Units without grain counts write -1.
+std::vector<std::vector<double>> summarizeScenario(const RenderScenario& scenario) {
+    const ScenarioRender render = renderScenario(scenario);
+    const int numOutputs = scenario.numOutputs;
+    const int numFrames = static_cast<int>(render.frames.size()) / numOutputs;
+    const int block = scenario.params.blockSize;
+    std::vector<std::vector<double>> rows;
+
+    for (int start = 0; start < numFrames; start += SUMMARY_WINDOW) {
+        const int end = std::min(numFrames, start + SUMMARY_WINDOW);
+        std::vector<double> row;
+        int started = -1;
+        int active = -1;
+
+        if (!render.grains.empty()) {
+            started = 0;
+            for (int b = start / block; b < end / block; ++b) {
+                started += render.grains[2 * b];
+            }
+            active = render.grains[2 * (end / block - 1) + 1];
+        }
+        row.push_back(started);
+        row.push_back(active);
+
+        for (int ch = 0; ch < numOutputs; ++ch) {
+            double sum = 0.0;
+            for (int i = start; i < end; ++i) {
+                const double value = render.frames[static_cast<size_t>(i) * numOutputs + ch];
+                sum += value * value;
+            }
+            row.push_back(std::sqrt(sum / (end - start)));
+        }
+        rows.push_back(row);
+    }
+    return rows;
+}
+
+// summarize <file>: write the summary of all scenarios, check <file>: compare this build with it
+int runSummary(const std::string& mode, const std::string& path) {
+    if (mode == "summarize") {
+        std::FILE* file = std::fopen(path.c_str(), "w");
+
+        if (file == nullptr) {
+            std::fprintf(stderr, "can't write %s\n", path.c_str());
+            return 1;
+        }
+        std::fprintf(file, "# GrainDelayBench summarize: scenario window started active rms...\n");
+
+        for (const RenderScenario& scenario : renderScenarios()) {
+            const std::vector<std::vector<double>> rows = summarizeScenario(scenario);
+
+            for (size_t w = 0; w < rows.size(); ++w) {
+                std::fprintf(file, "%s %zu %d %d", scenario.name, w, static_cast<int>(rows[w][0]), static_cast<int>(rows[w][1]));
+                for (size_t k = 2; k < rows[w].size(); ++k) {
+                    std::fprintf(file, " %.9g", rows[w][k]);
+                }
+                std::fprintf(file, "\n");
+            }
+        }
+        std::fclose(file);
+        return 0;
+    }
+
+    std::FILE* file = std::fopen(path.c_str(), "r");
+
+    if (file == nullptr) {
+        std::fprintf(stderr, "can't read %s\n", path.c_str());
+        return 1;
+    }
+
+    // The whole file as lines, skipping the header
+    std::vector<std::string> lines;
+    char line[4096];
+
+    while (std::fgets(line, sizeof(line), file) != nullptr) {
+        if (line[0] != '#') {
+            lines.push_back(line);
+        }
+    }
+    std::fclose(file);
+
+    std::printf("reference summary %s, tolerance %g\n", path.c_str(), SUMMARY_TOLERANCE);
+    bool passed = true;
+
+    for (const RenderScenario& scenario : renderScenarios()) {
+        const std::vector<std::vector<double>> rows = summarizeScenario(scenario);
+        const std::string prefix = std::string(scenario.name) + " ";
+        size_t numReference = 0;
+        int countsDiffering = 0;
+        double maxRelative = 0.0;
+
+        for (const std::string& text : lines) {
+            if (text.compare(0, prefix.size(), prefix) != 0) {
+                continue;
+            }
+
+            // window started active rms...
+            std::vector<double> values;
+            const char* pos = text.c_str() + prefix.size();
+            char* next = nullptr;
+
+            for (double value = std::strtod(pos, &next); next != pos; value = std::strtod(pos, &next)) {
+                values.push_back(value);
+                pos = next;
+            }
+
+            const size_t w = static_cast<size_t>(values.empty() ? -1 : values[0]);
+            ++numReference;
+
+            if (w >= rows.size() || values.size() != rows[w].size() + 1) {
+                countsDiffering = std::max(countsDiffering, 1);
+                maxRelative = std::numeric_limits<double>::infinity();
+                continue;
+            }
+            if (values[1] != rows[w][0] || values[2] != rows[w][1]) {
+                ++countsDiffering;
+            }
+            for (size_t k = 2; k < rows[w].size(); ++k) {
+                const double relative = std::abs(rows[w][k] - values[k + 1]) / std::max(values[k + 1], 1e-4);
+                maxRelative = relative == relative ? std::max(maxRelative, relative) : std::numeric_limits<double>::infinity();
+            }
+        }
+
+        const bool ok = numReference == rows.size() && countsDiffering == 0 && maxRelative <= SUMMARY_TOLERANCE;
+        std::printf("  %-12s windows %zu, grain counts differ in %d, max RMS error %-10.3g %s\n", scenario.name, numReference,
+            countsDiffering, maxRelative, ok ? "ok" : (numReference == rows.size() ? "FAILED" : "FAILED (windows differ)"));
+        passed = ok && passed;
+    }
+    return passed ? 0 : 1;
+}
+
+// render <dir>: write the references, compare <dir> [tolerance]: check this build against them
+int runReferences(const std::string& mode, const std::string& dir, float tolerance) {
+    bool passed = true;
+
+    if (mode == "compare") {
+        std::printf("reference renders in %s, tolerance %g\n", dir.c_str(), tolerance);
+    }
+
+    for (const RenderScenario& scenario : renderScenarios()) {
+        if (mode == "render") {
+            if (!writeReference(dir, scenario)) {
+                std::fprintf(stderr, "can't write the references of %s to %s\n", scenario.name, dir.c_str());
+                return 1;
+            }
+        } else {
+            passed = compareReference(dir, scenario, tolerance) && passed;
+        }
+    }
+    return passed ? 0 : 1;
+}
+
+} // namespace
+
+int main(int argc, char** argv) {
+    // usage: GrainDelayBench [seconds per configuration]
+    //        GrainDelayBench render <dir>
+    //        GrainDelayBench compare <dir> [tolerance]
+    //        GrainDelayBench summarize <file>
+    //        GrainDelayBench check <file>
+    const std::string mode = argc > 1 ? argv[1] : "";
+    const bool references = (mode == "render" || mode == "compare") && argc > 2;
+    const bool summary = (mode == "summarize" || mode == "check") && argc > 2;
+    const double seconds = argc > 1 && !references && !summary ? std::max(0.1, std::atof(argv[1])) : 2.0;
+
+    static InterfaceTable table{};
+    table.fPrint = mockPrint;
+    table.fRTAlloc = mockAlloc;
+    table.fRTFree = mockFree;
+    table.fDefineUnit = mockDefineUnit;
+    table.fDefineUnitCmd = mockDefineUnitCmd;
+    table.fClearUnitOutputs = mockClearUnitOutputs;
+    table.fDoAsynchronousCommand = mockAsynchronousCommand;
+    table.fSendNodeReply = mockSendNodeReply;
+    load(&table);
+
+    if (references) {
+        return runReferences(mode, argv[2], argc > 3 ? static_cast<float>(std::atof(argv[3])) : 1e-4f);
+    }
+    if (summary) {
+        return runSummary(mode, argv[2]);
+    }
+
+    benchKernels();
+    benchSweeps(seconds);
+    return 0;
+}
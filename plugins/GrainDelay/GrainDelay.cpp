@@ -1,138 +1,1996 @@
 #include "GrainDelay.hpp"
+#include "GrainDelayBank.hpp"
 #include "SC_PlugIn.hpp"
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <memory>
+#include <new>
+
+#ifdef _WIN32
+    #ifndef WIN32_LEAN_AND_MEAN
+        #define WIN32_LEAN_AND_MEAN
+    #endif
+    #ifndef NOMINMAX
+        #define NOMINMAX
+    #endif
+    #include <windows.h>
+#else
+    #include <fcntl.h>
+    #include <sys/mman.h>
+    #include <unistd.h>
+#endif
 
 static InterfaceTable* ft;
 
+// Window tables shared by all instances, filled at plugin load. Nothing writes them
+// afterwards, so supernova's DSP threads read them concurrently without locking.
+static Utils::WindowTables s_windowTables;
+
 // ===== GRAIN DELAY =====
 
 GrainDelay::GrainDelay() : 
     m_sampleRate(static_cast<float>(sampleRate())),
     m_sampleDur(static_cast<float>(sampleDur())),
-    m_bufFrames(MAX_DELAY_TIME * m_sampleRate),
-    m_bufSize(static_cast<int>(m_bufFrames)),
-    m_eventSystem(NUM_CHANNELS)
+    m_maxDelayTime(clipMaxDelayTime(in0(MaxDelayTime))),
+    m_long(in0(LongDelay) > 0.5f && in0(BufNum) < 0.0f && m_maxDelayTime > LONG_WINDOW_TIME),
+    m_bufSize(static_cast<int>(Utils::nextPowerOfTwo(static_cast<size_t>(std::ceil((m_long ? LONG_WINDOW_TIME : m_maxDelayTime) * m_sampleRate)) + 4))),
+    m_bufFrames(static_cast<float>(m_bufSize)),
+    m_numOutputs(static_cast<int>(numOutputs())),
+    m_external(in0(BufNum) >= 0.0f),
+    m_lineFormat(m_external || m_long ? Utils::LineFormat::Float : static_cast<Utils::LineFormat>(sc_clip(static_cast<int>(in0(LineFormat)), 0, static_cast<int>(Utils::LineFormat::NumFormats) - 1))),
+    m_maxGrains(Utils::nextPowerOfTwo(sc_clip(static_cast<int>(std::ceil(in0(MaxGrains))), MIN_GRAINS, MAX_GRAINS))),
+    m_stealFadeStep(-1.0f / std::max(1.0f, STEAL_FADE_TIME * m_sampleRate)),
+    m_resetFadeStep(-1.0f / std::max(1.0f, RESET_FADE_TIME * m_sampleRate)),
+    m_lastTriggerRate(in0(TriggerRate)),
+    m_lastOverlap(sc_clip(in0(Overlap), MIN_OVERLAP, static_cast<float>(m_maxGrains))),
+    m_lastDelayTime(sc_clip(in0(DelayTime), m_sampleDur, m_maxDelayTime)),
+    m_lastGrainRate(sc_clip(in0(GrainRate), MIN_GRAIN_RATE, MAX_GRAIN_RATE))
 {
-    // Initialize audio buffer & graindata
-    m_buffer.resize(m_bufSize, 0.0f);
-    m_grainData.resize(NUM_CHANNELS);
+    // Allocate audio buffer and grain accumulators from the real-time pool,
+    // whatever was allocated is released in the destructor. An external
+    // Buffer replaces the internal delay line, which is then never allocated.
+    if (!m_external) {
+        const size_t sampleBytes = m_lineFormat == Utils::LineFormat::Float ? sizeof(float) : sizeof(uint16);
+        m_lineMemory = RTAlloc(mWorld, static_cast<size_t>(Utils::RingBuffer::allocationSize(m_bufSize)) * sampleBytes);
+    }
+    m_grainBlock = static_cast<float*>(RTAlloc(mWorld, bufferSize() * sizeof(float)));
+    
+    // A long line keeps its recent samples in the ring above, and adds the far rings, the
+    // slot table with one flag per page, and the stream. The store itself is allocated on the
+    // non-realtime thread. It is a whole number of rings long and a ring longer than the
+    // longest delay, so a page sits at the same ring position on every lap.
+    if (m_long) {
+        const size_t maxDelaySamples = static_cast<size_t>(std::ceil(m_maxDelayTime * m_sampleRate));
+        const size_t bufSize = static_cast<size_t>(m_bufSize);
+        m_historyLength = static_cast<int>((maxDelaySamples / bufSize + 2) * bufSize);
+        m_numPages = m_historyLength / LONG_PAGE_SIZE;
+        m_numRings = m_maxGrains + NUM_FADE_TAILS + STAGED_GRAINS;
+        
+        for (int k = 0; k < STAGED_GRAINS; ++k) {
+            m_stagingRings[k] = m_maxGrains + NUM_FADE_TAILS + k;
+        }
+        m_farMemory = RTAlloc(mWorld, m_numRings * Utils::RingBuffer::allocationSize(LONG_RING_SIZE) * sizeof(float));
+        m_tableMemory = RTAlloc(mWorld, m_numRings * RING_PAGES * sizeof(FarSlot) + m_numPages);
+        m_stream = static_cast<Stream*>(RTAlloc(mWorld, sizeof(Stream)));
+        
+        if (m_stream != nullptr) {
+            new (m_stream) Stream();
+            m_stream->unit = this;
+            m_stream->storeFrames = static_cast<size_t>(m_historyLength);
+            
+            for (int k = 0; k < Stream::SAVE_PAGES; ++k) {
+                m_stream->freePages[m_stream->numFreePages++] = k;
+            }
+        }
+    }
+    
+    // Multichannel output gets one panned accumulator per channel
+    bool panAllocFailed = false;
+    
+    if (m_numOutputs > 1) {
+        m_panBlock = static_cast<float*>(RTAlloc(mWorld, m_numOutputs * bufferSize() * sizeof(float)));
+        panAllocFailed = m_panBlock == nullptr;
+    }
+    
+    // The voice count selects a calc function with fixed-size voice loops
+    bool voicesAllocated = false;
+    
+    switch (m_maxGrains) {
+        case 4: voicesAllocated = initVoices<4>(); break;
+        case 8: voicesAllocated = initVoices<8>(); break;
+        case 16: voicesAllocated = initVoices<16>(); break;
+        case 32: voicesAllocated = initVoices<32>(); break;
+        default: voicesAllocated = initVoices<64>(); break;
+    }
+    
+    const bool longAllocFailed = m_long && (m_farMemory == nullptr || m_tableMemory == nullptr || m_stream == nullptr);
+    
+    if ((!m_external && m_lineMemory == nullptr) || m_grainBlock == nullptr || panAllocFailed || !voicesAllocated || longAllocFailed) {
+        Print("GrainDelay: RT memory allocation failed, try increasing the real-time memory size in the server options\n");
+        mCalcFunc = make_calc_function<GrainDelay, &GrainDelay::next_silent>();
+        next_silent(1);
+        return;
+    }
+    
+    if (!m_external) {
+        switch (m_lineFormat) {
+            case Utils::LineFormat::Int16: m_int16Buffer.init(static_cast<uint16*>(m_lineMemory), m_bufSize); break;
+            case Utils::LineFormat::Half: m_halfBuffer.init(static_cast<uint16*>(m_lineMemory), m_bufSize); break;
+            default:
+                m_buffer.init(static_cast<float*>(m_lineMemory), m_bufSize);
+                m_lineData = m_buffer.data;
+                break;
+        }
+        m_lineSize = m_bufSize;
+        m_lineFrames = m_bufFrames;
+        m_delayLimit = m_maxDelayTime;
+        
+        if (!m_long) {
+            m_historyLength = m_bufSize;
+        }
+        m_silentSamples = m_historyLength;
+    }
+    
+    if (m_long) {
+        std::fill_n(static_cast<float*>(m_farMemory), m_numRings * Utils::RingBuffer::allocationSize(LONG_RING_SIZE), 0.0f);
+        m_farSlots = static_cast<FarSlot*>(m_tableMemory);
+        
+        for (int slot = 0; slot < m_numRings * RING_PAGES; ++slot) {
+            new (m_farSlots + slot) FarSlot();
+        }
+        
+        m_pageStored = reinterpret_cast<uint8*>(m_farSlots + m_numRings * RING_PAGES);
+        std::fill(m_pageStored, m_pageStored + m_numPages, 0);
+        m_recentLimit = m_bufSize - 2 * LONG_PAGE_SIZE;
+        m_prefetchSamples = static_cast<int>(std::ceil(LONG_PREFETCH_TIME * m_sampleRate));
+        
+        m_stream->busy = true;
+        DoAsynchronousCommand(mWorld, nullptr, "grainDelayStream", m_stream, &streamAllocate, &streamStart, nullptr, &streamDone, 0, nullptr);
+    }
+    
+    m_dcBlocker.setCutoff(DC_BLOCK_CUTOFF, m_sampleRate);
+    (mCalcFunc)(this, 1);
+}
+
+template <int MaxGrains>
+bool GrainDelay::initVoices() {
+    // RTAlloc only guarantees malloc alignment, over-allocate and align the pool by hand
+    m_voicesMemory = RTAlloc(mWorld, sizeof(Voices<MaxGrains>) + VOICES_ALIGNMENT);
+    
+    if (m_voicesMemory == nullptr) {
+        return false;
+    }
+    
+    void* aligned = m_voicesMemory;
+    size_t space = sizeof(Voices<MaxGrains>) + VOICES_ALIGNMENT;
+    m_voices = std::align(VOICES_ALIGNMENT, sizeof(Voices<MaxGrains>), aligned, space);
+    new (m_voices) Voices<MaxGrains>();
+    
+    for (int slot = 0; slot < Voices<MaxGrains>::NUM_SLOTS; ++slot) {
+        voices<MaxGrains>().ring[slot] = slot;
+    }
+    for (int t = 0; t < NUM_FADE_TAILS; ++t) {
+        voices<MaxGrains>().fadeTails[t] = MaxGrains + t;
+    }
+    
+    // Specialize on the rates of the modulatable inputs
+    const int numAudioRate = isAudioRateIn(TriggerRate) + isAudioRateIn(Overlap) + isAudioRateIn(DelayTime) + isAudioRateIn(GrainRate);
+    
+    if (numAudioRate == 4) {
+        mCalcFunc = make_calc_function<GrainDelay, &GrainDelay::next<Utils::ParamRates::Audio, MaxGrains>>();
+    } else if (numAudioRate == 0) {
+        mCalcFunc = make_calc_function<GrainDelay, &GrainDelay::next<Utils::ParamRates::Control, MaxGrains>>();
+    } else {
+        mCalcFunc = make_calc_function<GrainDelay, &GrainDelay::next<Utils::ParamRates::Mixed, MaxGrains>>();
+    }
+    return true;
+}
+
+GrainDelay::~GrainDelay() {
+    // A snapshot command still in flight finishes without the unit, a copy in progress
+    // only has its memory left to release
+    if (m_snapshot != nullptr) {
+        m_snapshot->unit = nullptr;
+        
+        if (m_snapshot->copying) {
+            m_snapshot->copying = false;
+            DoAsynchronousCommand(mWorld, nullptr, "grainDelaySnapshotFree", m_snapshot, &snapshotRelease, nullptr, nullptr, &snapshotDone, 0, nullptr);
+        }
+    }
+    
+    // A transfer of a long line may still fill the far rings, the stream frees them once no
+    // batch is in flight
+    if (m_stream != nullptr) {
+        m_stream->unit = nullptr;
+        m_stream->farMemory = m_farMemory;
+        m_farMemory = nullptr;
+        
+        if (!m_stream->busy) {
+            releaseStream(mWorld, m_stream);
+        }
+    }
+    if (m_farMemory != nullptr) {
+        RTFree(mWorld, m_farMemory);
+    }
+    if (m_tableMemory != nullptr) {
+        RTFree(mWorld, m_tableMemory);
+    }
+    if (m_lineMemory != nullptr) {
+        RTFree(mWorld, m_lineMemory);
+    }
+    if (m_grainBlock != nullptr) {
+        RTFree(mWorld, m_grainBlock);
+    }
+    if (m_panBlock != nullptr) {
+        RTFree(mWorld, m_panBlock);
+    }
+    if (m_voicesMemory != nullptr) {
+        RTFree(mWorld, m_voicesMemory);
+    }
+}
+
+void GrainDelay::next_silent(int nSamples) {
+    ClearUnitOutputs(this, nSamples);
+}
+
+bool GrainDelay::bindExternalBuffer() {
+    // Same lookup as the server's GET_BUF, including synth-local buffers
+    const auto bufnum = static_cast<uint32>(std::max(0.0f, in0(BufNum)));
+    World* world = mWorld;
+    
+    if (bufnum >= world->mNumSndBufs) {
+        const int localBufNum = bufnum - world->mNumSndBufs;
+        Graph* parent = mParent;
+        
+        if (localBufNum <= parent->localBufNum) {
+            m_sndBuf = parent->mLocalSndBufs + localBufNum;
+        } else {
+            m_sndBuf = world->mSndBufs;
+        }
+    } else {
+        m_sndBuf = world->mSndBufs + bufnum;
+    }
+    
+    // Grains only read the Buffer in read-only mode, so other readers can share it.
+    // The lock is held for the whole block and released before next() returns.
+    SndBuf* buf = m_sndBuf;
+    m_lineWritable = in0(ReadOnly) <= 0.5f;
+    
+    if (m_lineWritable) {
+        ACQUIRE_SNDBUF(buf);
+    } else {
+        ACQUIRE_SNDBUF_SHARED(buf);
+    }
+    
+    // The delay line has to be a mono Buffer long enough for a 4-point read
+    if (buf->data == nullptr || buf->channels != 1 || buf->frames < 4) {
+        releaseExternalBuffer();
+        return false;
+    }
+    
+    m_lineData = buf->data;
+    m_lineSize = buf->frames;
+    m_lineFrames = static_cast<float>(m_lineSize);
+    m_delayLimit = std::max(m_sampleDur, static_cast<float>(m_lineSize - 4) * m_sampleDur);
+    m_lastDelayTime = std::min(m_lastDelayTime, m_delayLimit);
+    
+    // The Buffer may have been swapped for a shorter one
+    if (m_writePos >= m_lineSize) {
+        m_writePos = 0;
+    }
+    
+    return true;
+}
+
+void GrainDelay::releaseExternalBuffer() {
+    if (m_lineWritable) {
+        RELEASE_SNDBUF(m_sndBuf);
+    } else {
+        RELEASE_SNDBUF_SHARED(m_sndBuf);
+    }
+}
+
+int GrainDelay::wrapLine(int index) const {
+    return m_external ? sc_wrap(index, 0, m_lineSize - 1) : index & (m_bufSize - 1);
+}
+
+Utils::ParamSignal GrainDelay::paramSignal(int index, float& lastValue, float lo, float hi) {
+    if (isAudioRateIn(index)) {
+        return Utils::ParamSignal{in(index), 0.0f, 0.0f, lo, hi};
+    }
+    
+    const float next = sc_clip(in0(index), lo, hi);
+    Utils::ParamSignal signal{nullptr, lastValue, calcSlope(next, lastValue), lo, hi};
+    lastValue = next;
+    return signal;
+}
+
+template <int MaxGrains>
+void GrainDelay::startGrain(float overlap, float delayTime, float grainRate, const Utils::WindowTable& window, float pan, float spread, int stealMode, float delayJitter, float rateJitter) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    int g = pool.eventSystem.startChannel(overlap);
+    
+    // All voices busy: drop the grain, or fade out a playing one and take its voice
+    if (g < 0) {
+        if (stealMode == StealDrop) {
+            ++m_stats.dropped;
+            return;
+        }
+        
+        g = stealVoice<MaxGrains>(stealMode);
+        pool.eventSystem.restartChannel(g, overlap);
+        ++m_stats.stolen;
+    }
+    
+    ++m_stats.startedSinceQuery;
+    m_stats.peakActive = std::max(m_stats.peakActive, pool.eventSystem.numActive);
+    
+    // Jitter is drawn once per grain, the RNG is only touched when it is enabled
+    RGen& rgen = *mParent->mRGen;
+    
+    if (delayJitter > 0.0f) {
+        float draw = 0.0f;
+        
+        // A long line draws STAGED_GRAINS grains ahead, so prefetchPages knows where they read
+        if (!m_long) {
+            draw = rgen.frand2();
+        } else {
+            if (!m_delayDrawn) {
+                for (float& next : m_delayDraws) {
+                    next = rgen.frand2();
+                }
+                m_delayDrawn = true;
+            }
+            draw = m_delayDraws[0];
+            std::copy(m_delayDraws + 1, m_delayDraws + STAGED_GRAINS, m_delayDraws);
+            m_delayDraws[STAGED_GRAINS - 1] = rgen.frand2();
+        }
+        delayTime = sc_clip(delayTime * (1.0f + delayJitter * draw), m_sampleDur, m_delayLimit);
+    }
+    if (rateJitter > 0.0f) {
+        grainRate = sc_clip(grainRate * std::exp2(rateJitter * rgen.frand2()), MIN_GRAIN_RATE, MAX_GRAIN_RATE);
+    }
+
+    // Calculate read position
+    float normalizedWritePos = static_cast<float>(m_writePos) / m_lineFrames;
+    float normalizedDelay = std::max(1.0f / m_lineFrames, delayTime * m_sampleRate / m_lineFrames);
+    float readPos = sc_wrap(normalizedWritePos - normalizedDelay, 0.0f, 1.0f);
+    
+    // store grain data
+    pool.readPos[g] = readPos;
+    pool.rate[g] = grainRate;
+    pool.phase[g] = grainRate * static_cast<float>(pool.eventSystem.channelOffsets[g]);
+    pool.window[g] = &window;
+    pool.fade[g] = 1.0f;
+    pool.fadeStep[g] = 0.0f;
+    pool.lineStart[g] = -1;
+    
+    // Latch the output position, spread scatters grains around the pan center
+    if (m_panBlock != nullptr) {
+        const float position = sc_fold(pan + spread * rgen.frand2(), -1.0f, 1.0f);
+        pool.pan[g] = Utils::panPosition(position, m_numOutputs);
+    }
+    
+    if (m_long) {
+        placeLongGrain<MaxGrains>(g, delayTime);
+    }
+}
+
+template <int MaxGrains>
+int GrainDelay::stealVoice(int stealMode) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    const typename Voices<MaxGrains>::Events& eventSystem = pool.eventSystem;
+    int victim = eventSystem.oldestChannel;
+    
+    // The quietest grain is found once per stolen trigger, never per sample
+    if (stealMode == StealQuietest) {
+        float lowestGain = std::numeric_limits<float>::max();
+        
+        for (int k = 0; k < eventSystem.numActive; ++k) {
+            const int ch = eventSystem.activeChannels[k];
+            const float gain = pool.window[ch]->lookup(static_cast<float>(eventSystem.channelPhases[ch])) * pool.fade[ch];
+            
+            if (gain < lowestGain) {
+                lowestGain = gain;
+                victim = ch;
+            }
+        }
+    }
+    
+    // Move the victim into a fade tail slot, replacing the quietest tail when all are in use
+    int slot;
+    
+    if (pool.numFadeTails < NUM_FADE_TAILS) {
+        slot = pool.fadeTails[pool.numFadeTails++];
+    } else {
+        slot = pool.fadeTails[0];
+        for (int t = 1; t < NUM_FADE_TAILS; ++t) {
+            if (pool.fade[pool.fadeTails[t]] < pool.fade[slot]) {
+                slot = pool.fadeTails[t];
+            }
+        }
+    }
+    
+    pool.copySlot(victim, slot);
+    pool.fadeStep[slot] = pool.fade[slot] * m_stealFadeStep;
+    return victim;
+}
+
+template <int MaxGrains>
+int GrainDelay::safeBlockLength(int maxLength) const {
+    // Grains read the delay line while the block writes it. Limit the span so no tap
+    // reaches a sample this span writes, which keeps single-sample feedback exact.
+    // Grains on the far rings of a long line never read what the head writes.
+    const Voices<MaxGrains>& pool = voices<MaxGrains>();
+    int length = maxLength;
+    
+    for (int k = 0; k < pool.eventSystem.numActive && length > 1; ++k) {
+        const int ch = pool.eventSystem.activeChannels[k];
+        
+        if (pool.lineStart[ch] < 0) {
+            length = safeGrainLength(pool.readPos[ch], pool.phase[ch], pool.rate[ch], length);
+        }
+    }
+    for (int t = 0; t < pool.numFadeTails && length > 1; ++t) {
+        const int slot = pool.fadeTails[t];
+        
+        if (pool.lineStart[slot] < 0) {
+            length = safeGrainLength(pool.readPos[slot], pool.phase[slot], pool.rate[slot], length);
+        }
+    }
+    
+    return length;
+}
+
+int GrainDelay::safeGrainLength(float readPos, float phase, float rate, int maxLength) const {
+    // Distance from the write head to the lowest tap of the widest interpolator, and the
+    // room left before the taps wrap around onto it (rounding headroom of 1/16 sample per step)
+    const int firstTap = static_cast<int>((readPos * m_lineFrames) + phase) - 2;
+    const int behind = wrapLine(firstTap - m_writePos);
+    const int ahead = static_cast<int>((m_lineSize - behind - 8) / (rate + 0.0625f));
+    
+    return std::min(maxLength, std::max(1, std::min(behind, ahead)));
+}
+
+// Windowed reads of one of the internal ring buffers
+template <class Line>
+static void accumulateLine(const Line& line, Utils::InterpMode mode, const float* phases, const float* window, float* accum, int numSamples) {
+    using Utils::InterpMode;
+    
+    switch (mode) {
+        case InterpMode::None: Utils::accumulateWindowed<InterpMode::None>(line, phases, window, accum, numSamples); break;
+        case InterpMode::Linear: Utils::accumulateWindowed<InterpMode::Linear>(line, phases, window, accum, numSamples); break;
+        case InterpMode::Hermite6: Utils::accumulateWindowed<InterpMode::Hermite6>(line, phases, window, accum, numSamples); break;
+        default: Utils::accumulateWindowed<InterpMode::Cubic>(line, phases, window, accum, numSamples); break;
+    }
+}
+
+void GrainDelay::accumulateGrain(Utils::InterpMode mode, int ring, const float* phases, const float* window, float* accum, int numSamples) const {
+    using Utils::InterpMode;
+    
+    if (ring >= 0) {
+        accumulateLine(farRing(ring), mode, phases, window, accum, numSamples);
+    } else if (m_external) {
+        switch (mode) {
+            case InterpMode::None: Utils::accumulateWindowed<InterpMode::None>(m_lineData, m_lineSize, phases, window, accum, numSamples); break;
+            case InterpMode::Linear: Utils::accumulateWindowed<InterpMode::Linear>(m_lineData, m_lineSize, phases, window, accum, numSamples); break;
+            case InterpMode::Hermite6: Utils::accumulateWindowed<InterpMode::Hermite6>(m_lineData, m_lineSize, phases, window, accum, numSamples); break;
+            default: Utils::accumulateWindowed<InterpMode::Cubic>(m_lineData, m_lineSize, phases, window, accum, numSamples); break;
+        }
+    } else {
+        switch (m_lineFormat) {
+            case Utils::LineFormat::Int16: accumulateLine(m_int16Buffer, mode, phases, window, accum, numSamples); break;
+            case Utils::LineFormat::Half: accumulateLine(m_halfBuffer, mode, phases, window, accum, numSamples); break;
+            default: accumulateLine(m_buffer, mode, phases, window, accum, numSamples); break;
+        }
+    }
+}
+
+template <int MaxGrains>
+bool GrainDelay::renderGrain(int slot, int blockOffset, int numSamples) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    const Utils::PanPosition& pan = pool.pan[slot];
+    float* accum = m_grainBlock + blockOffset;
+    
+    // Panned accumulators of the two output channels the grain sits between
+    float* panLow = nullptr;
+    float* panHigh = nullptr;
+    
+    if (m_panBlock != nullptr) {
+        panLow = m_panBlock + pan.channel * bufferSize() + blockOffset;
+        panHigh = panLow + bufferSize();
+    }
+    
+    // A grain on a far ring of a long line is muted while its pages aren't loaded
+    const int lineStart = pool.lineStart[slot];
+    const int ring = lineStart >= 0 ? pool.ring[slot] : -1;
+    const float lineFrames = ring >= 0 ? static_cast<float>(LONG_RING_SIZE) : m_lineFrames;
+    
+    Utils::GrainCursor grain(pool.eventSystem, slot, *pool.window[slot], pool.readPos[slot] * lineFrames,
+                             pool.rate[slot], pool.phase[slot], pool.fade[slot], pool.fadeStep[slot]);
+    bool active = true;
+    
+    // At unity rate from a whole-sample position every read lands on a sample,
+    // which a plain copy reproduces exactly
+    const bool aligned = grain.rate == 1.0f && grain.readOffset == std::floor(grain.readOffset) && grain.phase == std::floor(grain.phase);
+    const Utils::InterpMode interpMode = aligned ? Utils::InterpMode::None : m_interpMode;
+    
+    const int readStart = static_cast<int>(grain.readOffset);
+    bool missed = false;
+    
+    // Read positions and window gains are accumulated sequentially, then the
+    // interpolation and windowing run through the SIMD kernel
+    float phases[KERNEL_BLOCK_SIZE];
+    float window[KERNEL_BLOCK_SIZE];
+    int offset = 0;
+    
+    while (active && offset < numSamples) {
+        const int count = std::min(KERNEL_BLOCK_SIZE, numSamples - offset);
+        const int n = grain.fill(phases, window, count);
+        active = n == count;
+        
+        if (ring >= 0 && n > 0) {
+            missed = muteMissingPages(ring, lineStart, readStart, phases, window, n) || missed;
+        } else if (m_clearing) {
+            muteStaleReads(phases, window, n);
+        }
+        
+        if (panLow == nullptr) {
+            accumulateGrain(interpMode, ring, phases, window, accum + offset, n);
+        } else {
+            // Render the chunk once, then add it to the mono sum and the panned outputs
+            float grainChunk[KERNEL_BLOCK_SIZE];
+            std::fill(grainChunk, grainChunk + n, 0.0f);
+            accumulateGrain(interpMode, ring, phases, window, grainChunk, n);
+            
+            for (int i = 0; i < n; ++i) {
+                accum[offset + i] += grainChunk[i];
+                panLow[offset + i] += grainChunk[i] * pan.gainLow;
+                panHigh[offset + i] += grainChunk[i] * pan.gainHigh;
+            }
+        }
+        offset += n;
+    }
+    
+    if (missed) {
+        ++m_stats.streamMisses;
+    }
+    
+    grain.store(pool.eventSystem, slot);
+    pool.phase[slot] = grain.phase;
+    pool.fade[slot] = grain.fade;
+    return active;
+}
+
+template <int MaxGrains>
+void GrainDelay::renderGrains(int blockOffset, int numSamples) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    typename Voices<MaxGrains>::Events& eventSystem = pool.eventSystem;
+    int k = 0;
+    
+    while (k < eventSystem.numActive) {
+        const int ch = eventSystem.activeChannels[k];
+        
+        if (renderGrain<MaxGrains>(ch, blockOffset, numSamples)) {
+            ++k;
+        } else {
+            eventSystem.releaseActive(k);
+        }
+    }
+    
+    // Fade tails of stolen grains, swapped behind the live ones when done so their slot is free again
+    int t = 0;
+    
+    while (t < pool.numFadeTails) {
+        if (renderGrain<MaxGrains>(pool.fadeTails[t], blockOffset, numSamples)) {
+            ++t;
+        } else {
+            std::swap(pool.fadeTails[t], pool.fadeTails[--pool.numFadeTails]);
+        }
+    }
+}
+
+template <int MaxGrains>
+bool GrainDelay::skipGrain(int slot, int numSamples) {
+    // Moves a grain on as renderGrain does, without reading the line
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    const float lineFrames = pool.lineStart[slot] >= 0 ? static_cast<float>(LONG_RING_SIZE) : m_lineFrames;
+    
+    Utils::GrainCursor grain(pool.eventSystem, slot, *pool.window[slot], pool.readPos[slot] * lineFrames,
+                             pool.rate[slot], pool.phase[slot], pool.fade[slot], pool.fadeStep[slot]);
+    bool active = true;
+    
+    float phases[KERNEL_BLOCK_SIZE];
+    float window[KERNEL_BLOCK_SIZE];
+    int offset = 0;
+    
+    while (active && offset < numSamples) {
+        const int count = std::min(KERNEL_BLOCK_SIZE, numSamples - offset);
+        const int n = grain.fill(phases, window, count);
+        active = n == count;
+        offset += n;
+    }
+    
+    grain.store(pool.eventSystem, slot);
+    pool.phase[slot] = grain.phase;
+    pool.fade[slot] = grain.fade;
+    return active;
+}
+
+template <int MaxGrains>
+void GrainDelay::skipGrains(int numSamples) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    typename Voices<MaxGrains>::Events& eventSystem = pool.eventSystem;
+    int k = 0;
+    
+    while (k < eventSystem.numActive) {
+        if (skipGrain<MaxGrains>(eventSystem.activeChannels[k], numSamples)) {
+            ++k;
+        } else {
+            eventSystem.releaseActive(k);
+        }
+    }
+    
+    int t = 0;
+    
+    while (t < pool.numFadeTails) {
+        if (skipGrain<MaxGrains>(pool.fadeTails[t], numSamples)) {
+            ++t;
+        } else {
+            std::swap(pool.fadeTails[t], pool.fadeTails[--pool.numFadeTails]);
+        }
+    }
+}
+
+// A delay line resident in the RT pool is bounded far below a long line, longer
+// requests need longDelay. Both stay a margin below MAX_LINE_FRAMES, so rounding
+// the line up to a power of two or whole rings cannot overflow an int.
+float GrainDelay::clipMaxDelayTime(float requested) const {
+    const bool external = in0(BufNum) >= 0.0f;
+    const bool longLine = in0(LongDelay) > 0.5f && !external;
+    const float limit = std::min(longLine ? MAX_LONG_DELAY_TIME : MAX_DELAY_TIME,
+                                 static_cast<float>(MAX_LINE_FRAMES - 65536) / m_sampleRate);
+    if (requested > limit && !external) {
+        Print("GrainDelay: maxDelayTime %g s clipped to %g s%s\n", requested, limit,
+              longLine ? "" : ", use longDelay for longer delays");
+    }
+    return sc_clip(requested, m_sampleDur, limit);
+}
+
+bool GrainDelay::isIdle(const float* input, int numSamples) const {
+    // Another synth may write a shared Buffer, only the internal line is known to be silent
+    if (m_external || m_silentSamples < m_historyLength || m_dampingFilter.m_state != 0.0f || m_dcBlocker.m_state != 0.0f) {
+        return false;
+    }
+    
+    for (int i = 0; i < numSamples; ++i) {
+        if (input[i] != 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+void GrainDelay::writeLine(int index, float value) {
+    switch (m_lineFormat) {
+        case Utils::LineFormat::Int16: m_int16Buffer.write(index, value); break;
+        case Utils::LineFormat::Half: m_halfBuffer.write(index, value); break;
+        default: m_buffer.write(index, value); break;
+    }
+}
+
+// All-zero bits are silence in every line format
+template <class Line>
+static void zeroRing(Line& line, int start, int count) {
+    const int firstPart = std::min(count, line.size - start);
+    std::fill_n(line.data + start, firstPart, 0);
+    std::fill_n(line.data, count - firstPart, 0);
+    line.updateGuard();
+}
+
+void GrainDelay::zeroLine(int start, int count) {
+    switch (m_lineFormat) {
+        case Utils::LineFormat::Int16: zeroRing(m_int16Buffer, start, count); break;
+        case Utils::LineFormat::Half: zeroRing(m_halfBuffer, start, count); break;
+        default: zeroRing(m_buffer, start, count); break;
+    }
+}
+
+void GrainDelay::advanceClear(int numWritten) {
+    // Samples written this block are clean, then the slice just behind the clean part
+    // is zeroed. Writing and zeroing both grow the clean part, so a clear takes at most
+    // one line length divided by CLEAR_SLICE_SIZE blocks.
+    m_cleanLength = std::min(m_lineSize, m_cleanLength + numWritten);
+    
+    // A save in progress copies the rest of the line as it was when it started, reads of
+    // the stale part stay muted meanwhile
+    if (m_snapshot != nullptr && m_snapshot->copying) {
+        return;
+    }
+    
+    const int count = std::min(CLEAR_SLICE_SIZE, m_lineSize - m_cleanLength);
+    zeroLine(wrapLine(m_writePos - m_cleanLength - count), count);
+    m_cleanLength += count;
+    m_clearing = m_cleanLength < m_lineSize;
+}
+
+void GrainDelay::muteStaleReads(const float* phases, float* gains, int numSamples) const {
+    // A read is muted when its oldest tap lies beyond the clean part of the line, or its
+    // newest taps reach ahead of the write head into samples written before the reset
+    for (int i = 0; i < numSamples; ++i) {
+        const int distance = wrapLine(m_writePos - static_cast<int>(phases[i]));
+        
+        if (distance < 4 || distance + 2 > m_cleanLength) {
+            gains[i] = 0.0f;
+        }
+    }
+}
+
+// ===== LONG DELAY LINE =====
+
+int GrainDelay::wrapHistory(int position) const {
+    position %= m_historyLength;
+    return position < 0 ? position + m_historyLength : position;
+}
+
+int GrainDelay::currentLinePosition() const {
+    // The head moved less than a ring since the start of the block
+    return wrapHistory(m_linePosition + ((m_writePos - m_linePosition) & (m_bufSize - 1)));
+}
+
+Utils::RingBuffer GrainDelay::farRing(int ring) const {
+    float* data = static_cast<float*>(m_farMemory) + static_cast<size_t>(ring) * Utils::RingBuffer::allocationSize(LONG_RING_SIZE);
+    return Utils::RingBuffer{data, LONG_RING_SIZE, LONG_RING_SIZE - 1};
+}
+
+int GrainDelay::findPage(int page) const {
+    // Far slot of any ring holding the page ready, -1 if none
+    const int numSlots = m_numRings * RING_PAGES;
+    
+    for (int index = page & (RING_PAGES - 1); index < numSlots; index += RING_PAGES) {
+        if (m_farSlots[index].page == page && m_farSlots[index].ready) {
+            return index;
+        }
+    }
+    return -1;
+}
+
+bool GrainDelay::requestPages(int ring, int first, int last) {
+    // Fills the pages of the samples first..last into a far ring, true when all of them are
+    // ready. The RT thread copies a page still in m_buffer or in another ring and zeroes a
+    // silent one, the others are loaded.
+    const int head = currentLinePosition();
+    const int start = wrapHistory(first);
+    const int count = (start % LONG_PAGE_SIZE + last - first) / LONG_PAGE_SIZE + 1;
+    bool ready = count <= RING_PAGES;
+    
+    for (int k = 0; k < std::min(count, RING_PAGES); ++k) {
+        const int page = (start / LONG_PAGE_SIZE + k) % m_numPages;
+        const int index = ring * RING_PAGES + (page & (RING_PAGES - 1));
+        FarSlot& slot = m_farSlots[index];
+        
+        if (slot.page == page || slot.loading) {
+            ready = ready && slot.page == page && slot.ready;
+            continue;
+        }
+        
+        // Distance of the page's first sample behind the head, the head's own page isn't complete
+        const int distance = wrapHistory(head - page * LONG_PAGE_SIZE);
+        const bool recent = distance <= m_bufSize;
+        const int source = recent || !m_pageStored[page] ? -1 : findPage(page);
+        const bool copied = recent || !m_pageStored[page] || source >= 0;
+        
+        if (distance < LONG_PAGE_SIZE || (copied && m_pageCopies == MAX_PAGE_COPIES)) {
+            ready = false;
+            continue;
+        }
+        
+        float* samples = farRing(ring).data + (page & (RING_PAGES - 1)) * LONG_PAGE_SIZE;
+        slot.page = page;
+        slot.ready = false;
+        
+        if (copied) {
+            // Another ring's copy first, the part of m_buffer a reset has not cleared yet is silent
+            if (source >= 0) {
+                const float* from = farRing(source / RING_PAGES).data + (page & (RING_PAGES - 1)) * LONG_PAGE_SIZE;
+                std::copy(from, from + LONG_PAGE_SIZE, samples);
+            } else if (recent && !(m_clearing && distance > m_cleanLength)) {
+                const float* from = m_buffer.data + ((page * LONG_PAGE_SIZE) & (m_bufSize - 1));
+                std::copy(from, from + LONG_PAGE_SIZE, samples);
+            } else {
+                std::fill(samples, samples + LONG_PAGE_SIZE, 0.0f);
+            }
+            ++m_pageCopies;
+            slot.ready = true;
+            
+            if ((page & (RING_PAGES - 1)) == 0) {
+                farRing(ring).updateGuard();
+            }
+        } else if (queueTransfer(samples, page, index, true)) {
+            slot.loading = true;
+        } else {
+            slot.page = -1;
+        }
+        
+        ready = ready && slot.ready;
+    }
+    
+    return ready;
+}
+
+bool GrainDelay::farPagesReady(int ring, int first, int last) const {
+    const int start = wrapHistory(first);
+    const int count = (start % LONG_PAGE_SIZE + last - first) / LONG_PAGE_SIZE + 1;
+    
+    if (count > RING_PAGES) {
+        return false;
+    }
+    
+    for (int k = 0; k < count; ++k) {
+        const int page = (start / LONG_PAGE_SIZE + k) % m_numPages;
+        const FarSlot& slot = m_farSlots[ring * RING_PAGES + (page & (RING_PAGES - 1))];
+        
+        if (slot.page != page || !slot.ready) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <int MaxGrains>
+void GrainDelay::prefetchPages(float delayTime, float grainRate, float delayJitter, float rateJitter) {
+    m_pageCopies = 0;
+    
+    const Voices<MaxGrains>& pool = voices<MaxGrains>();
+    const int maxReach = LONG_RING_SIZE - 2 * LONG_PAGE_SIZE;
+    
+    // Playing grains first, from their read position to where they read after LONG_PREFETCH_TIME
+    auto prefetchGrain = [&](int slot) {
+        if (pool.lineStart[slot] >= 0) {
+            const int position = pool.lineStart[slot] + static_cast<int>(pool.phase[slot]);
+            const int reach = std::min(maxReach, static_cast<int>(pool.rate[slot] * m_prefetchSamples));
+            requestPages(pool.ring[slot], position - 3, position + reach + 4);
+        }
+    };
+    
+    for (int k = 0; k < pool.eventSystem.numActive; ++k) {
+        prefetchGrain(pool.eventSystem.activeChannels[k]);
+    }
+    for (int t = 0; t < pool.numFadeTails; ++t) {
+        prefetchGrain(pool.fadeTails[t]);
+    }
+    
+    // Then the staging rings of the next grains. Their onsets move along with the head and
+    // each reads on at up to the fastest jittered rate. With delay jitter every grain has
+    // its own onset, drawn ahead, without it the next grain's ring is enough: a grain
+    // starting in the same block copies the pages from it.
+    if (delayJitter > 0.0f && !m_delayDrawn) {
+        return;
+    }
+    
+    const float fastestRate = std::min(MAX_GRAIN_RATE, grainRate * std::exp2(rateJitter));
+    const int reach = std::min(maxReach, static_cast<int>((1.0f + fastestRate) * m_prefetchSamples));
+    const int numStaged = delayJitter > 0.0f ? STAGED_GRAINS : 1;
+    
+    for (int k = 0; k < numStaged; ++k) {
+        const float jittered = delayJitter > 0.0f ? delayTime * (1.0f + delayJitter * m_delayDraws[k]) : delayTime;
+        const float delaySamples = sc_clip(jittered, m_sampleDur, m_delayLimit) * m_sampleRate;
+        
+        if (delaySamples > static_cast<float>(m_recentLimit / 2)) {
+            const int onset = currentLinePosition() - static_cast<int>(delaySamples);
+            requestPages(m_stagingRings[k], onset - 3, onset + reach + 4);
+        }
+    }
+}
+
+template <int MaxGrains>
+void GrainDelay::placeLongGrain(int slot, float delayTime) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    
+    // Onset on the long line. m_buffer and the far rings hold each sample at its line
+    // position modulo their size, so the ring position follows from it.
+    const double delaySamples = std::max(1.0, static_cast<double>(delayTime) * m_sampleRate);
+    const double onset = static_cast<double>(currentLinePosition()) - delaySamples;
+    const double onsetFloor = std::floor(onset);
+    const float fraction = static_cast<float>(onset - onsetFloor);
+    int lineStart = wrapHistory(static_cast<int>(onsetFloor));
+    
+    // Grains that stay within the recent samples over the whole window read m_buffer,
+    // slower than unity they fall further behind the head as they play
+    const double remaining = (1.0 - pool.eventSystem.channelPhases[slot]) / pool.eventSystem.channelSlopes[slot];
+    const double farthest = delaySamples + std::max(0.0, (1.0 - pool.rate[slot]) * remaining) + 8.0;
+    const bool far = farthest >= static_cast<double>(m_recentLimit);
+    const int ringSize = far ? LONG_RING_SIZE : m_bufSize;
+    float readOffset = static_cast<float>(lineStart & (ringSize - 1)) + fraction;
+    
+    // A fraction that rounds up to the next sample moves the onset there
+    if (static_cast<int>(readOffset) != (lineStart & (ringSize - 1))) {
+        lineStart = wrapHistory(lineStart + 1);
+        readOffset = static_cast<float>(lineStart & (ringSize - 1));
+    }
+    pool.readPos[slot] = readOffset / static_cast<float>(ringSize);
+    
+    // Every grain takes over the first staging ring, so the others stay in line with the
+    // delay draws. The slot's old ring is staged last.
+    const int staged = m_stagingRings[0];
+    std::copy(m_stagingRings + 1, m_stagingRings + STAGED_GRAINS, m_stagingRings);
+    m_stagingRings[STAGED_GRAINS - 1] = pool.ring[slot];
+    pool.ring[slot] = staged;
+    
+    if (!far) {
+        return;
+    }
+    
+    // The others read their ring, and are dropped when their first block isn't ready
+    pool.lineStart[slot] = lineStart;
+    const int firstReads = static_cast<int>(pool.rate[slot] * static_cast<float>(bufferSize())) + 8;
+    
+    if (!requestPages(pool.ring[slot], lineStart - 3, lineStart + firstReads)) {
+        pool.fade[slot] = 0.0f;
+        ++m_stats.streamMisses;
+    }
+}
+
+bool GrainDelay::muteMissingPages(int ring, int lineStart, int readStart, const float* phases, float* gains, int numSamples) const {
+    // Taps of the widest interpolator around the first and last read of the chunk
+    const int first = lineStart + static_cast<int>(phases[0]) - readStart - 3;
+    const int last = lineStart + static_cast<int>(phases[numSamples - 1]) - readStart + 4;
+    
+    if (farPagesReady(ring, first, last)) {
+        return false;
+    }
+    
+    std::fill(gains, gains + numSamples, 0.0f);
+    return true;
+}
+
+void GrainDelay::advanceLongLine(int numSamples) {
+    // The head moved numSamples since the start of the block, each page it finished is saved
+    const int start = m_linePosition;
+    int pageEnd = (start / LONG_PAGE_SIZE + 1) * LONG_PAGE_SIZE;
+    
+    while (pageEnd <= start + numSamples) {
+        completePage((pageEnd / LONG_PAGE_SIZE - 1) % m_numPages, start + numSamples - pageEnd);
+        pageEnd += LONG_PAGE_SIZE;
+    }
+    
+    m_linePosition = wrapHistory(start + numSamples);
+}
+
+void GrainDelay::completePage(int page, int written) {
+    // Far slots still holding the page from the last lap are out of date
+    const int numSlots = m_numRings * RING_PAGES;
+    
+    for (int index = page & (RING_PAGES - 1); index < numSlots; index += RING_PAGES) {
+        FarSlot& slot = m_farSlots[index];
+        
+        if (slot.page == page && !slot.loading) {
+            slot.page = -1;
+            slot.ready = false;
+        }
+    }
+    
+    // 'written' samples of the next page came after it, a silent page isn't saved
+    if (m_silentSamples >= LONG_PAGE_SIZE + written) {
+        m_pageStored[page] = 0;
+        return;
+    }
+    
+    // After a reset, the part of the page the head didn't write since is silent
+    const int ringStart = (page * LONG_PAGE_SIZE) & (m_bufSize - 1);
+    
+    if (m_clearing) {
+        const int stale = std::min(LONG_PAGE_SIZE, LONG_PAGE_SIZE + written - m_cleanLength);
+        
+        if (stale > 0) {
+            zeroLine(ringStart, stale);
+        }
+    }
+    
+    // The save gets a copy of the page. With the queue or the staging pages full the page
+    // is lost to the far reads, which then read silence.
+    Stream& stream = *m_stream;
+    
+    if (stream.numFreePages > 0) {
+        const int staging = stream.freePages[stream.numFreePages - 1];
+        
+        if (queueTransfer(stream.savePages[staging], page, staging, false)) {
+            --stream.numFreePages;
+            std::copy(m_buffer.data + ringStart, m_buffer.data + ringStart + LONG_PAGE_SIZE, stream.savePages[staging]);
+            return;
+        }
+    }
+    m_pageStored[page] = 0;
+}
+
+void GrainDelay::resetLongLine() {
+    // Transfers queued or in flight carry the old generation and are ignored when done
+    ++m_streamGeneration;
+    std::fill(m_pageStored, m_pageStored + m_numPages, 0);
+    
+    for (int index = 0; index < m_numRings * RING_PAGES; ++index) {
+        FarSlot& slot = m_farSlots[index];
+        
+        if (!slot.loading) {
+            slot.page = -1;
+            slot.ready = false;
+        }
+    }
+}
+
+bool GrainDelay::queueTransfer(float* samples, int page, int slot, bool load) {
+    Stream& stream = *m_stream;
+    
+    if (stream.numQueued == Stream::MAX_TRANSFERS) {
+        return false;
+    }
+    
+    stream.queued[stream.numQueued++] = Stream::Transfer{samples, page, slot, m_streamGeneration, load};
+    return true;
+}
+
+void GrainDelay::postTransfers() {
+    // The queue goes out as one batch once the store exists and the last batch is done
+    Stream& stream = *m_stream;
+    
+    if (stream.busy || !stream.ready || stream.numQueued == 0) {
+        return;
+    }
     
-    mCalcFunc = make_calc_function<GrainDelay, &GrainDelay::next_aa>();
-    next_aa(1);
+    std::copy(stream.queued, stream.queued + stream.numQueued, stream.transfers);
+    stream.numTransfers = stream.numQueued;
+    stream.numQueued = 0;
+    stream.busy = true;
+    DoAsynchronousCommand(mWorld, nullptr, "grainDelayTransfer", &stream, &streamTransfer, &streamComplete, nullptr, &streamDone, 0, nullptr);
 }
 
-GrainDelay::~GrainDelay() = default;
+void GrainDelay::completeTransfers() {
+    Stream& stream = *m_stream;
+    
+    for (int k = 0; k < stream.numTransfers; ++k) {
+        const Stream::Transfer& transfer = stream.transfers[k];
+        const bool current = transfer.generation == m_streamGeneration;
+        
+        if (transfer.load) {
+            // Loading slots are never reassigned, the slot still belongs to this page
+            FarSlot& slot = m_farSlots[transfer.slot];
+            slot.loading = false;
+            slot.ready = current;
+            
+            if (!current) {
+                slot.page = -1;
+            } else if ((transfer.page & (RING_PAGES - 1)) == 0) {
+                farRing(transfer.slot / RING_PAGES).updateGuard();
+            }
+        } else {
+            stream.freePages[stream.numFreePages++] = transfer.slot;
+            
+            if (current) {
+                m_pageStored[transfer.page] = 1;
+            }
+        }
+    }
+    
+    stream.numTransfers = 0;
+}
 
-void GrainDelay::next_aa(int nSamples) {
+template <Utils::ParamRates Rates, int MaxGrains>
+void GrainDelay::next(int nSamples) {
+    GRAINDELAY_PROFILE_START(m_profile, Block);
+    
+    // An unusable external Buffer outputs silence and holds all grain state
+    if (m_external && !bindExternalBuffer()) {
+        ClearUnitOutputs(this, nSamples);
+        GRAINDELAY_PROFILE_END_BLOCK(m_profile);
+        return;
+    }
+    
+    // A snapshot in progress copies its slice before this block writes the line
+    if (m_snapshot != nullptr && m_snapshot->copying) {
+        advanceSnapshot(nSamples);
+    }
+    
     // Get audio I/O
     const float* input = in(Input);
     float* output = out(Output);
     
-    // Audio-rate parameters
-    const float* triggerRateIn = in(TriggerRate);
-    const float* overlapIn = in(Overlap);
-    const float* delayTimeIn = in(DelayTime);
-    const float* grainRateIn = in(GrainRate);
+    // Modulatable parameters, audio rate or ramped control rate
+    constexpr float maxRate = std::numeric_limits<float>::max();
+    const float startOverlap = m_lastOverlap;
+    const Utils::ParamSignal triggerRate = paramSignal(TriggerRate, m_lastTriggerRate, -maxRate, maxRate);
+    const Utils::ParamSignal overlap = paramSignal(Overlap, m_lastOverlap, MIN_OVERLAP, static_cast<float>(MaxGrains));
+    const Utils::ParamSignal delayTime = paramSignal(DelayTime, m_lastDelayTime, m_sampleDur, m_delayLimit);
+    const Utils::ParamSignal grainRate = paramSignal(GrainRate, m_lastGrainRate, MIN_GRAIN_RATE, MAX_GRAIN_RATE);
+    
+    // With all inputs at control rate the compensation gain is ramped between the block ends
+    float gainStart = 0.0f;
+    float gainStep = 0.0f;
+    
+    if constexpr (Rates == Utils::ParamRates::Control) {
+        gainStart = Utils::overlapCompensation(startOverlap);
+        gainStep = calcSlope(Utils::overlapCompensation(m_lastOverlap), gainStart);
+    }
     
     // Control-rate parameters
     const float mix = sc_clip(in0(Mix), 0.0f, 1.0f);
     const float feedback = sc_clip(in0(Feedback), 0.0f, 0.99f);
     const float damping = sc_clip(in0(Damping), 0.0f, 1.0f);
     const bool freeze = in0(Freeze) > 0.5f;
+    const bool writing = m_lineWritable && !freeze;
     const bool reset = in0(Reset) > 0.5f;
+    const Utils::WindowTable& window = s_windowTables.get(static_cast<int>(in0(WindowType)));
+    const float pan = in0(Pan);
+    const float spread = sc_clip(in0(Spread), 0.0f, 1.0f);
+    const int stealMode = sc_clip(static_cast<int>(in0(StealMode)), 0, 2);
+    const float delayJitter = sc_clip(in0(DelayJitter), 0.0f, 1.0f);
+    const float rateJitter = sc_clip(in0(RateJitter), 0.0f, MAX_RATE_JITTER);
+    m_interpMode = static_cast<Utils::InterpMode>(sc_clip(static_cast<int>(in0(Interpolation)), 0, static_cast<int>(Utils::InterpMode::NumModes) - 1));
     
-    for (int i = 0; i < nSamples; ++i) {
-        
-        // Sample audio-rate parameters per-sample
-        float triggerRate = triggerRateIn[i];
-        float overlap = sc_clip(overlapIn[i], 0.001f, static_cast<float>(NUM_CHANNELS));
-        float delayTime = sc_clip(delayTimeIn[i], m_sampleDur, MAX_DELAY_TIME);
-        float grainRate = sc_clip(grainRateIn[i], 0.125f, 4.0f);
-        
-        // 1. Get trigger info from subsample-accurate system
-        auto channelPhases = m_eventSystem.process(
-            triggerRate, 
-            reset, 
-            overlap, 
-            m_sampleRate
-        );
-        
-        // 2. Process all grains
-        float delayed = 0.0f;
-   
-        for (int g = 0; g < NUM_CHANNELS; ++g) {
-
-            // Trigger new grain if needed
-            if (m_eventSystem.justTriggered[g]) {
-
-                // Calculate read position
-                float normalizedWritePos = static_cast<float>(m_writePos) / m_bufFrames;
-                float normalizedDelay = std::max(m_sampleDur, delayTime * m_sampleRate / m_bufFrames);
-                float readPos = sc_wrap(normalizedWritePos - normalizedDelay, 0.0f, 1.0f);
-                
-                // store grain data
-                m_grainData[g].readPos = readPos;
-                m_grainData[g].rate = grainRate;
-                m_grainData[g].hasTriggered = true;
-                m_grainData[g].phase = grainRate * static_cast<float>(m_eventSystem.channelOffsets[g]);
+    m_dampingFilter.setCoefficient(damping);
+    
+    // A reset trigger fades the wet signal out over RESET_FADE_TIME, no new grains start
+    // until it has faded and the reset input is released
+    if (reset && !m_lastReset) {
+        m_resetFading = true;
+    }
+    m_lastReset = reset;
+    
+    // Silent input into a silent line can only output silence. Grains still start and
+    // play on, so they read the input once it arrives, but nothing is read or mixed.
+    if (!reset && !m_resetFading && isIdle(input, nSamples)) {
+        ClearUnitOutputs(this, nSamples);
+        
+        typename Voices<MaxGrains>::Events& eventSystem = voices<MaxGrains>().eventSystem;
+        
+        if (m_long) {
+            prefetchPages<MaxGrains>(delayTime.at<Rates>(0), grainRate.at<Rates>(0), delayJitter, rateJitter);
+        }
+        
+        GRAINDELAY_PROFILE_START(m_profile, Triggers);
+        int nextTrigger = eventSystem.template nextTrigger<Rates>(triggerRate, m_sampleRate, 0, nSamples);
+        GRAINDELAY_PROFILE_STOP(m_profile, Triggers);
+        int segmentStart = 0;
+        
+        while (segmentStart < nSamples) {
+            if (nextTrigger == segmentStart) {
+                GRAINDELAY_PROFILE_START(m_profile, Triggers);
+                startGrain<MaxGrains>(
+                    overlap.at<Rates>(segmentStart),
+                    delayTime.at<Rates>(segmentStart),
+                    grainRate.at<Rates>(segmentStart),
+                    window,
+                    pan,
+                    spread,
+                    stealMode,
+                    delayJitter,
+                    rateJitter
+                );
+                nextTrigger = eventSystem.template nextTrigger<Rates>(triggerRate, m_sampleRate, segmentStart + 1, nSamples);
+                GRAINDELAY_PROFILE_STOP(m_profile, Triggers);
             }
             
-            // Process grain if the event system says it's active
-            if (m_eventSystem.isActive[g]) {
-
-                // Advance phase
-                m_grainData[g].phase += m_grainData[g].rate;
+            const int segmentLength = nextTrigger - segmentStart;
+            
+            GRAINDELAY_PROFILE_START(m_profile, Grains);
+            skipGrains<MaxGrains>(segmentLength);
+            GRAINDELAY_PROFILE_STOP(m_profile, Grains);
+            
+            // The write head moves with the segments, startGrain measures the delay from it.
+            // The line is only logically silent while a clear runs, the head zeroes what it passes.
+            if (!freeze) {
+                if (m_clearing) {
+                    zeroLine(m_writePos, segmentLength);
+                }
+                m_writePos = wrapLine(m_writePos + segmentLength);
+            }
+            segmentStart = nextTrigger;
+        }
+        
+        if (m_long && !freeze) {
+            advanceLongLine(nSamples);
+        }
+        if (m_clearing) {
+            advanceClear(freeze ? 0 : nSamples);
+        }
+        if (m_long) {
+            postTransfers();
+        }
+        
+        m_stats.active = eventSystem.numActive;
+        m_stats.samplesSinceQuery += nSamples;
+        GRAINDELAY_PROFILE_END_BLOCK(m_profile);
+        return;
+    }
+    
+    float* grainBlock = m_grainBlock;
+    std::fill(grainBlock, grainBlock + nSamples, 0.0f);
+    
+    if (m_panBlock != nullptr) {
+        for (int c = 0; c < m_numOutputs; ++c) {
+            std::fill(m_panBlock + c * bufferSize(), m_panBlock + c * bufferSize() + nSamples, 0.0f);
+        }
+    }
+    
+    typename Voices<MaxGrains>::Events& eventSystem = voices<MaxGrains>().eventSystem;
+    
+    // Pages of a long line for the grains of this block and the next ones
+    if (m_long) {
+        prefetchPages<MaxGrains>(delayTime.at<Rates>(0), grainRate.at<Rates>(0), delayJitter, rateJitter);
+    }
+    
+    // Playing grains fade out with the wet gain during a reset
+    float wetGain = m_resetFade;
+    const float wetGainStep = m_resetFading ? m_resetFadeStep : 0.0f;
+    
+    GRAINDELAY_PROFILE_START(m_profile, Triggers);
+    int nextTrigger = reset || m_resetFading ? nSamples : eventSystem.template nextTrigger<Rates>(triggerRate, m_sampleRate, 0, nSamples);
+    GRAINDELAY_PROFILE_STOP(m_profile, Triggers);
+    int segmentStart = 0;
+    
+    while (segmentStart < nSamples) {
+        
+        // 1. Start the grain triggered on the first sample of this segment, if any,
+        // and find the next trigger, which ends the segment
+        if (nextTrigger == segmentStart) {
+            GRAINDELAY_PROFILE_START(m_profile, Triggers);
+            startGrain<MaxGrains>(
+                overlap.at<Rates>(segmentStart),
+                delayTime.at<Rates>(segmentStart),
+                grainRate.at<Rates>(segmentStart),
+                window,
+                pan,
+                spread,
+                stealMode,
+                delayJitter,
+                rateJitter
+            );
+            nextTrigger = eventSystem.template nextTrigger<Rates>(triggerRate, m_sampleRate, segmentStart + 1, nSamples);
+            GRAINDELAY_PROFILE_STOP(m_profile, Triggers);
+        }
+        
+        const int segmentEnd = nextTrigger;
+        
+        // 2. Render the segment in spans that never read what they write
+        int spanStart = segmentStart;
+        
+        while (spanStart < segmentEnd) {
+            const int maxLength = segmentEnd - spanStart;
+            const int spanLength = writing ? safeBlockLength<MaxGrains>(maxLength) : maxLength;
+            const int spanEnd = spanStart + spanLength;
+            
+            // Render each grain across the span into the block accumulator
+            GRAINDELAY_PROFILE_START(m_profile, Grains);
+            renderGrains<MaxGrains>(spanStart, spanLength);
+            GRAINDELAY_PROFILE_STOP(m_profile, Grains);
+            
+            GRAINDELAY_PROFILE_START(m_profile, Feedback);
+            for (int i = spanStart; i < spanEnd; ++i) {
                 
-                // Calculate grain phase: readPos + integrator phase
-                float grainPhase = (m_grainData[g].readPos * m_bufFrames) + m_grainData[g].phase;
+                // Read the dry sample first, an output may share the input's buffer
+                const float dry = input[i];
                 
-                // Get sample with interpolation
-                float grainSample = Utils::peekCubicInterp(
-                    m_buffer.data(), 
-                    m_bufSize, 
-                    grainPhase
-                );
+                // 3. Apply amplitude compensation based on overlap
+                float compensationGain;
+                
+                if constexpr (Rates == Utils::ParamRates::Control) {
+                    compensationGain = gainStart + gainStep * i;
+                } else {
+                    compensationGain = Utils::overlapCompensation(overlap.at<Rates>(i));
+                }
+                
+                compensationGain *= wetGain;
+                wetGain = std::max(0.0f, wetGain + wetGainStep);
+                
+                float delayed = grainBlock[i] * compensationGain;
+                
+                // 4. Apply feedback with damping filter
+                float dampedFeedback = m_dampingFilter.processLowpass(delayed);
+                
+                // 5. DC block input and write to delay buffer (only when not frozen),
+                // a read-only Buffer is never written but its write head keeps moving
+                float dcBlockedInput = m_dcBlocker.processHighpass(dry);
+                
+                if (writing) {
+                    const float value = zapgremlins(dcBlockedInput + dampedFeedback * feedback);
+                    m_silentSamples = value == 0.0f ? std::min(m_silentSamples + 1, m_historyLength) : 0;
+                    
+                    if (m_external) {
+                        m_lineData[m_writePos] = value;
+                    } else {
+                        writeLine(m_writePos, value);
+                    }
+                }
                 
-                // Apply Hanning window using subsample-accurate window phase
-                grainSample *= Utils::hanningWindow(channelPhases[g]);
-                delayed += grainSample;
+                if (!freeze) {
+                    m_writePos = wrapLine(m_writePos + 1);
+                }
+                
+                // 6. Output with wet/dry mix, the dry signal goes to every output
+                if (m_panBlock == nullptr) {
+                    output[i] = Utils::lerp(dry, delayed, mix);
+                } else {
+                    for (int c = 0; c < m_numOutputs; ++c) {
+                        out(c)[i] = Utils::lerp(dry, m_panBlock[c * bufferSize() + i] * compensationGain, mix);
+                    }
+                }
+            }
+            GRAINDELAY_PROFILE_STOP(m_profile, Feedback);
+            
+            // Reads of the next span may reach the samples this span wrote
+            if (m_clearing && writing) {
+                m_cleanLength = std::min(m_lineSize, m_cleanLength + spanLength);
             }
+            
+            spanStart = spanEnd;
         }
-
-        // 3. Apply amplitude compensation based on overlap
-        float effectiveOverlap = std::max(1.0f, overlap);
-        float compensationGain = 1.0f / std::sqrt(effectiveOverlap);
-        delayed *= compensationGain;
         
-        // 4. Apply feedback with damping filter
-        float dampedFeedback = m_dampingFilter.processLowpass(delayed, damping);
+        segmentStart = segmentEnd;
+    }
+    
+    if (m_long && !freeze) {
+        advanceLongLine(nSamples);
+    }
+    if (m_resetFading) {
+        m_resetFade = wetGain;
         
-        // 5. DC block input and write to delay buffer (only when not frozen)
-        float dcBlockedInput = m_dcBlocker.processHighpass(input[i], 3.0f, m_sampleRate);
+        if (wetGain <= 0.0f) {
+            this->reset<MaxGrains>();
+        }
+    }
+    if (m_clearing) {
+        advanceClear(0);
+    }
+    if (m_long) {
+        postTransfers();
+    }
+    
+    m_dampingFilter.flushDenormals();
+    m_dcBlocker.flushDenormals();
+    m_stats.active = eventSystem.numActive;
+    m_stats.samplesSinceQuery += nSamples;
+    
+    if (m_external) {
+        releaseExternalBuffer();
+    }
+    
+    GRAINDELAY_PROFILE_END_BLOCK(m_profile);
+}
+
+void GrainDelay::cmdStats(Unit* unit, sc_msg_iter* args) {
+    static_cast<GrainDelay*>(unit)->sendStats(args->geti(-1));
+}
+
+void GrainDelay::sendStats(int replyID) {
+    // Grains per second over the time since the last query
+    const float seconds = static_cast<float>(m_stats.samplesSinceQuery) * m_sampleDur;
+    const float grainsPerSecond = seconds > 0.0f ? static_cast<float>(m_stats.startedSinceQuery) / seconds : 0.0f;
+    
+    const float values[] = {
+        static_cast<float>(m_stats.active),
+        static_cast<float>(m_stats.dropped),
+        static_cast<float>(m_stats.peakActive),
+        grainsPerSecond,
+        static_cast<float>(m_stats.stolen),
+        static_cast<float>(m_stats.streamMisses)
+    };
+    SendNodeReply(&mParent->mNode, replyID, "/grainStats", 6, values);
+    
+    // Peak and rate are measured per query, the counts since the synth started
+    m_stats.peakActive = m_stats.active;
+    m_stats.startedSinceQuery = 0;
+    m_stats.samplesSinceQuery = 0;
+}
+
+#ifdef GRAINDELAY_PROFILE
+void GrainDelay::cmdProfile(Unit* unit, sc_msg_iter* args) {
+    static_cast<GrainDelay*>(unit)->sendProfile(args->geti(-1));
+}
+
+void GrainDelay::sendProfile(int replyID) {
+    // Blocks measured, then min, mean and max ticks per block of each section
+    float values[1 + 3 * Utils::Profile::NumSections];
+    values[0] = static_cast<float>(m_profile.blocks);
+    m_profile.report(values + 1);
+    SendNodeReply(&mParent->mNode, replyID, "/grainProfile", 1 + 3 * Utils::Profile::NumSections, values);
+    m_profile.clear();
+}
+#endif
+
+// ===== SNAPSHOTS =====
+
+// The internal delay line is stored as a mono 32-bit float WAV file, unrolled so the
+// file ends at the write head. Buffer.read loads it like any other recording.
+
+static void putU16(unsigned char* out, uint32 value) {
+    out[0] = static_cast<unsigned char>(value);
+    out[1] = static_cast<unsigned char>(value >> 8);
+}
+
+static void putU32(unsigned char* out, uint32 value) {
+    putU16(out, value);
+    putU16(out + 2, value >> 16);
+}
+
+static uint32 getU16(const unsigned char* in) {
+    return static_cast<uint32>(in[0]) | (static_cast<uint32>(in[1]) << 8);
+}
+
+static uint32 getU32(const unsigned char* in) {
+    return getU16(in) | (getU16(in + 2) << 16);
+}
+
+static bool writeFloatWav(const char* path, const float* samples, int frames, float sampleRate) {
+    FILE* file = std::fopen(path, "wb");
+    
+    if (file == nullptr) {
+        return false;
+    }
+    
+    const auto rate = static_cast<uint32>(sampleRate);
+    const auto dataBytes = static_cast<uint32>(frames * sizeof(float));
+    
+    unsigned char header[44];
+    std::memcpy(header, "RIFF", 4);
+    putU32(header + 4, 36 + dataBytes);
+    std::memcpy(header + 8, "WAVEfmt ", 8);
+    putU32(header + 16, 16);
+    putU16(header + 20, 3);             // IEEE float
+    putU16(header + 22, 1);             // Mono
+    putU32(header + 24, rate);
+    putU32(header + 28, rate * sizeof(float));
+    putU16(header + 32, sizeof(float));
+    putU16(header + 34, 32);
+    std::memcpy(header + 36, "data", 4);
+    putU32(header + 40, dataBytes);
+    
+    // Samples in host order, little-endian on every platform the server runs on
+    bool ok = std::fwrite(header, 1, sizeof(header), file) == sizeof(header);
+    ok = ok && std::fwrite(samples, sizeof(float), frames, file) == static_cast<size_t>(frames);
+    return std::fclose(file) == 0 && ok;
+}
+
+// Reads the last 'maxFrames' samples of a mono 32-bit float WAV file into memory
+// from malloc, nullptr if the file can't be read or has another format
+static float* readFloatWav(const char* path, int maxFrames, int& frames) {
+    FILE* file = std::fopen(path, "rb");
+    
+    if (file == nullptr) {
+        return nullptr;
+    }
+    
+    float* samples = nullptr;
+    unsigned char riff[12];
+    
+    if (std::fread(riff, 1, sizeof(riff), file) == sizeof(riff) && std::memcmp(riff, "RIFF", 4) == 0 && std::memcmp(riff + 8, "WAVE", 4) == 0) {
+        bool isFloatMono = false;
+        unsigned char chunk[8];
         
-        if (!freeze) {
-            m_buffer[m_writePos] = dcBlockedInput + dampedFeedback * feedback;
-            m_writePos++;
-            m_writePos = sc_wrap(m_writePos, 0, m_bufSize - 1);
+        while (std::fread(chunk, 1, sizeof(chunk), file) == sizeof(chunk)) {
+            const uint32 chunkSize = getU32(chunk + 4);
+            long skip = chunkSize;
+            
+            if (std::memcmp(chunk, "fmt ", 4) == 0 && chunkSize >= 16) {
+                unsigned char format[40] = {};
+                const uint32 formatSize = std::min<uint32>(chunkSize, sizeof(format));
+                
+                if (std::fread(format, 1, formatSize, file) != formatSize) {
+                    break;
+                }
+                
+                // WAVE_FORMAT_EXTENSIBLE keeps the format tag at the start of its subformat
+                const uint32 tag = getU16(format);
+                const uint32 formatTag = tag == 0xFFFE && formatSize >= 26 ? getU16(format + 24) : tag;
+                isFloatMono = formatTag == 3 && getU16(format + 2) == 1 && getU16(format + 14) == 32;
+                skip = chunkSize - formatSize;
+            } else if (std::memcmp(chunk, "data", 4) == 0) {
+                const auto fileFrames = static_cast<long>(chunkSize / sizeof(float));
+                frames = static_cast<int>(std::min<long>(fileFrames, maxFrames));
+                
+                if (isFloatMono && frames > 0 && std::fseek(file, (fileFrames - frames) * static_cast<long>(sizeof(float)), SEEK_CUR) == 0) {
+                    samples = static_cast<float*>(std::malloc(frames * sizeof(float)));
+                    
+                    if (samples != nullptr && std::fread(samples, sizeof(float), frames, file) != static_cast<size_t>(frames)) {
+                        std::free(samples);
+                        samples = nullptr;
+                    }
+                }
+                break;
+            }
+            
+            // Chunks are padded to an even size
+            if (std::fseek(file, skip + (chunkSize & 1), SEEK_CUR) != 0) {
+                break;
+            }
+        }
+    }
+    
+    std::fclose(file);
+    return samples;
+}
+
+void GrainDelay::cmdSave(Unit* unit, sc_msg_iter* args) {
+    const char* path = args->gets();
+    static_cast<GrainDelay*>(unit)->startSnapshot(false, path, args->geti(-1));
+}
+
+void GrainDelay::cmdLoad(Unit* unit, sc_msg_iter* args) {
+    const char* path = args->gets();
+    static_cast<GrainDelay*>(unit)->startSnapshot(true, path, args->geti(-1));
+}
+
+void GrainDelay::startSnapshot(bool load, const char* path, int replyID) {
+    // External Buffers are saved and loaded with the server's own Buffer commands
+    if (m_external || m_lineMemory == nullptr) {
+        Print("GrainDelay: snapshots need the internal delay line\n");
+        sendSnapshotReply(replyID, load, false);
+        return;
+    }
+    if (m_long) {
+        Print("GrainDelay: snapshots are not available in long delay mode\n");
+        sendSnapshotReply(replyID, load, false);
+        return;
+    }
+    if (path == nullptr || std::strlen(path) >= Snapshot::PATH_LENGTH) {
+        Print("GrainDelay: missing or too long snapshot path\n");
+        sendSnapshotReply(replyID, load, false);
+        return;
+    }
+    if (m_snapshot != nullptr) {
+        Print("GrainDelay: a snapshot is already in progress\n");
+        sendSnapshotReply(replyID, load, false);
+        return;
+    }
+    
+    auto* snapshot = static_cast<Snapshot*>(RTAlloc(mWorld, sizeof(Snapshot)));
+    
+    if (snapshot == nullptr) {
+        Print("GrainDelay: RT memory allocation failed for the snapshot\n");
+        sendSnapshotReply(replyID, load, false);
+        return;
+    }
+    
+    new (snapshot) Snapshot();
+    snapshot->unit = this;
+    snapshot->load = load;
+    snapshot->replyID = replyID;
+    snapshot->lineSize = m_bufSize;
+    snapshot->lineFormat = m_lineFormat;
+    snapshot->sampleRate = m_sampleRate;
+    std::strcpy(snapshot->path, path);
+    m_snapshot = snapshot;
+    
+    // A save is taken over by the unit once the memory is allocated. A load is decoded into a
+    // second line, which replaces the unit's line in one piece once it is complete.
+    DoAsynchronousCommand(mWorld, nullptr, load ? "grainDelayLoad" : "grainDelaySave", snapshot, load ? &snapshotRead : &snapshotAllocate,
+                          &snapshotStart, load ? &snapshotDecode : &snapshotRelease, &snapshotHandOver, 0, nullptr);
+}
+
+void GrainDelay::advanceSnapshot(int numSamples) {
+    // Slices of at least one block keep the copy ahead of the write head, so a save gets the
+    // line as it was when the copy started
+    Snapshot* snapshot = m_snapshot;
+    const int count = std::min(std::max(SNAPSHOT_SLICE_SIZE, numSamples), snapshot->lineSize - snapshot->cursor);
+    float* samples = snapshot->samples + snapshot->cursor;
+    copyLineOut(wrapLine(snapshot->head + snapshot->cursor), samples, count);
+    
+    // The oldest part of the line, which a reset had not cleared yet, is silent
+    const int stale = sc_clip(snapshot->stale - snapshot->cursor, 0, count);
+    std::fill(samples, samples + stale, 0.0f);
+    
+    snapshot->cursor += count;
+    
+    if (snapshot->cursor == snapshot->lineSize) {
+        finishSnapshot();
+    }
+}
+
+void GrainDelay::finishSnapshot() {
+    // The save hands its samples to the file
+    Snapshot* snapshot = m_snapshot;
+    snapshot->copying = false;
+    snapshot->frames = snapshot->lineSize;
+    
+    DoAsynchronousCommand(mWorld, nullptr, "grainDelaySave", snapshot, &snapshotWrite, nullptr, nullptr, &snapshotDone, 0, nullptr);
+}
+
+// Count samples of the line from start on, a float line is copied in two pieces
+template <class Line>
+static void unrollRing(const Line& line, int start, float* samples, int count) {
+    for (int i = 0; i < count; ++i) {
+        samples[i] = line.load(line.wrap(start + i));
+    }
+}
+
+void GrainDelay::copyLineOut(int start, float* samples, int count) const {
+    switch (m_lineFormat) {
+        case Utils::LineFormat::Int16: unrollRing(m_int16Buffer, start, samples, count); break;
+        case Utils::LineFormat::Half: unrollRing(m_halfBuffer, start, samples, count); break;
+        default: {
+            const int firstPart = std::min(count, m_bufSize - start);
+            std::copy(m_buffer.data + start, m_buffer.data + start + firstPart, samples);
+            std::copy(m_buffer.data, m_buffer.data + count - firstPart, samples + firstPart);
+            break;
+        }
+    }
+}
+
+template <class Line>
+static void rollRing(Line& line, int start, const float* samples, int count) {
+    for (int i = 0; i < count; ++i) {
+        line.write(line.wrap(start + i), samples[i]);
+    }
+}
+
+// Save, NRT: the second buffer the line is copied to
+bool GrainDelay::snapshotAllocate(World*, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    snapshot->samples = static_cast<float*>(std::malloc(snapshot->lineSize * sizeof(float)));
+    return snapshot->samples != nullptr;
+}
+
+// Save, NRT
+bool GrainDelay::snapshotWrite(World*, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    
+    if (snapshot->frames > 0) {
+        snapshot->ok = writeFloatWav(snapshot->path, snapshot->samples, snapshot->frames, snapshot->sampleRate);
+    }
+    
+    std::free(snapshot->samples);
+    snapshot->samples = nullptr;
+    return false;
+}
+
+// Load, NRT: at most one line of the end of the file
+bool GrainDelay::snapshotRead(World*, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    snapshot->samples = readFloatWav(snapshot->path, snapshot->lineSize, snapshot->frames);
+    return snapshot->samples != nullptr;
+}
+
+// RT, between two blocks: without the unit a save releases its memory, otherwise keeps it
+// for the unit. A load allocates the line the file is decoded into.
+bool GrainDelay::snapshotStart(World* world, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    
+    if (!snapshot->load || snapshot->unit == nullptr) {
+        return snapshot->unit == nullptr;
+    }
+    
+    const size_t sampleBytes = snapshot->lineFormat == Utils::LineFormat::Float ? sizeof(float) : sizeof(uint16);
+    snapshot->line = RTAlloc(world, static_cast<size_t>(Utils::RingBuffer::allocationSize(snapshot->lineSize)) * sampleBytes);
+    return true;
+}
+
+// Load, NRT: the file into the second line, ending just behind position 0
+bool GrainDelay::snapshotDecode(World*, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    const int start = snapshot->lineSize - snapshot->frames;
+    
+    if (snapshot->line != nullptr) {
+        switch (snapshot->lineFormat) {
+            case Utils::LineFormat::Int16: {
+                Utils::CompactRingBuffer<Utils::LineFormat::Int16> line;
+                line.init(static_cast<uint16*>(snapshot->line), snapshot->lineSize);
+                rollRing(line, start, snapshot->samples, snapshot->frames);
+                break;
+            }
+            case Utils::LineFormat::Half: {
+                Utils::CompactRingBuffer<Utils::LineFormat::Half> line;
+                line.init(static_cast<uint16*>(snapshot->line), snapshot->lineSize);
+                rollRing(line, start, snapshot->samples, snapshot->frames);
+                break;
+            }
+            default: {
+                Utils::RingBuffer line;
+                line.init(static_cast<float*>(snapshot->line), snapshot->lineSize);
+                std::copy(snapshot->samples, snapshot->samples + snapshot->frames, line.data + start);
+                line.updateGuard();
+                break;
+            }
+        }
+    }
+    
+    std::free(snapshot->samples);
+    snapshot->samples = nullptr;
+    return false;
+}
+
+// NRT, the last stage of a load or an abandoned snapshot
+bool GrainDelay::snapshotRelease(World*, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    std::free(snapshot->samples);
+    snapshot->samples = nullptr;
+    return false;
+}
+
+// RT, after the first command. A decoded load replaces the line here. For a save the unit
+// copies the line from the next block on and posts the last stage when done. A failed
+// stage ends the snapshot here.
+void GrainDelay::snapshotHandOver(World* world, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    GrainDelay* unit = snapshot->unit;
+    
+    if (snapshot->load) {
+        if (unit != nullptr && snapshot->line != nullptr) {
+            unit->swapLine(snapshot);
+            snapshot->ok = true;
+        }
+        snapshotDone(world, data);
+        return;
+    }
+    if (snapshot->samples == nullptr) {
+        snapshotDone(world, data);
+        return;
+    }
+    
+    // The synth went away after the RT stage, the memory is released on the NRT thread
+    if (unit == nullptr) {
+        DoAsynchronousCommand(world, nullptr, "grainDelaySnapshotFree", snapshot, &snapshotRelease, nullptr, nullptr, &snapshotDone, 0, nullptr);
+        return;
+    }
+    
+    snapshot->copying = true;
+    snapshot->head = unit->m_writePos;
+    snapshot->cursor = 0;
+    snapshot->stale = unit->m_clearing ? unit->m_lineSize - unit->m_cleanLength : 0;
+}
+
+// RT, after the last stage or a failed one
+void GrainDelay::snapshotDone(World* world, void* data) {
+    auto* snapshot = static_cast<Snapshot*>(data);
+    GrainDelay* unit = snapshot->unit;
+    
+    if (unit != nullptr) {
+        if (!snapshot->ok) {
+            Print("GrainDelay: could not %s snapshot %s\n", snapshot->load ? "load" : "save", snapshot->path);
         }
+        unit->m_snapshot = nullptr;
+        unit->sendSnapshotReply(snapshot->replyID, snapshot->load, snapshot->ok);
+    }
+    
+    // The old line after a load, or a decoded one nobody took
+    if (snapshot->line != nullptr) {
+        RTFree(world, snapshot->line);
+    }
+    RTFree(world, snapshot);
+}
+
+void GrainDelay::swapLine(Snapshot* snapshot) {
+    // The loaded line ends just behind position 0. The head moves there and every grain
+    // moves with it, keeping its delay. The old line goes to the snapshot to be freed.
+    std::swap(m_lineMemory, snapshot->line);
+    
+    switch (m_lineFormat) {
+        case Utils::LineFormat::Int16: m_int16Buffer.data = static_cast<uint16*>(m_lineMemory); break;
+        case Utils::LineFormat::Half: m_halfBuffer.data = static_cast<uint16*>(m_lineMemory); break;
+        default:
+            m_buffer.data = static_cast<float*>(m_lineMemory);
+            m_lineData = m_buffer.data;
+            break;
+    }
+    
+    switch (m_maxGrains) {
+        case 4: moveGrains<4>(-m_writePos); break;
+        case 8: moveGrains<8>(-m_writePos); break;
+        case 16: moveGrains<16>(-m_writePos); break;
+        case 32: moveGrains<32>(-m_writePos); break;
+        default: moveGrains<64>(-m_writePos); break;
+    }
+    m_writePos = 0;
+    
+    // The loaded line is neither silent nor waiting for a clear
+    m_silentSamples = 0;
+    m_clearing = false;
+}
+
+template <int MaxGrains>
+void GrainDelay::moveGrains(int offset) {
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    const float shift = static_cast<float>(offset) / m_lineFrames;
+    
+    for (int slot = 0; slot < Voices<MaxGrains>::NUM_SLOTS; ++slot) {
+        pool.readPos[slot] = sc_wrap(pool.readPos[slot] + shift, 0.0f, 1.0f);
+    }
+}
+
+void GrainDelay::sendSnapshotReply(int replyID, bool load, bool ok) {
+    const float values[] = {
+        load ? 1.0f : 0.0f,
+        ok ? 1.0f : 0.0f
+    };
+    SendNodeReply(&mParent->mNode, replyID, "/grainSnapshot", 2, values);
+}
+
+// ===== LONG LINE STREAM =====
+
+void GrainDelay::releaseStream(World* world, Stream* stream) {
+    DoAsynchronousCommand(world, nullptr, "grainDelayStreamFree", stream, &streamRelease, nullptr, nullptr, &streamFree, 0, nullptr);
+}
+
+// NRT: maps a new temporary file of 'bytes' bytes, removed once nothing maps it. The OS
+// writes the pages out to the file instead of keeping them in memory, the disk space is
+// reserved up front so a write never faults on a full disk. Returns nullptr on failure.
+static float* mapStore(size_t bytes) {
+#ifdef _WIN32
+    char dir[MAX_PATH];
+    char path[MAX_PATH];
+    
+    if (GetTempPathA(MAX_PATH, dir) == 0 || GetTempFileNameA(dir, "gdl", 0, path) == 0) {
+        return nullptr;
+    }
+    // The view keeps the file open, it is deleted when the view is unmapped
+    HANDLE file = CreateFileA(path, GENERIC_READ | GENERIC_WRITE, 0, nullptr, CREATE_ALWAYS,
+                              FILE_ATTRIBUTE_TEMPORARY | FILE_FLAG_DELETE_ON_CLOSE, nullptr);
+    if (file == INVALID_HANDLE_VALUE) {
+        DeleteFileA(path);
+        return nullptr;
+    }
+    const unsigned long long size = bytes;
+    HANDLE mapping = CreateFileMappingA(file, nullptr, PAGE_READWRITE, static_cast<DWORD>(size >> 32), static_cast<DWORD>(size), nullptr);
+    void* memory = mapping != nullptr ? MapViewOfFile(mapping, FILE_MAP_ALL_ACCESS, 0, 0, bytes) : nullptr;
+    
+    if (mapping != nullptr) {
+        CloseHandle(mapping);
+    }
+    CloseHandle(file);
+    return static_cast<float*>(memory);
+#else
+    const char* dir = std::getenv("TMPDIR");
+    char path[1024];
+    std::snprintf(path, sizeof(path), "%s/GrainDelayXXXXXX", dir != nullptr && *dir != '\0' ? dir : "/tmp");
+    
+    const int fd = mkstemp(path);
+    if (fd < 0) {
+        return nullptr;
+    }
+    unlink(path);
+    
+    #if defined(__APPLE__)
+        fstore_t reserve = {F_ALLOCATEALL, F_PEOFPOSMODE, 0, static_cast<off_t>(bytes), 0};
+        bool reserved = fcntl(fd, F_PREALLOCATE, &reserve) != -1 && ftruncate(fd, static_cast<off_t>(bytes)) == 0;
+    #else
+        bool reserved = posix_fallocate(fd, 0, static_cast<off_t>(bytes)) == 0;
+    #endif
+    void* memory = reserved ? mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0) : MAP_FAILED;
+    close(fd);
+    return memory != MAP_FAILED ? static_cast<float*>(memory) : nullptr;
+#endif
+}
+
+static void unmapStore(float* store, size_t bytes) {
+#ifdef _WIN32
+    (void)bytes;
+    UnmapViewOfFile(store);
+#else
+    munmap(store, bytes);
+#endif
+}
+
+// NRT: the whole line in a temporary file, or on the heap if no file can be mapped, where
+// untouched pages of a large allocation cost no memory until written
+bool GrainDelay::streamAllocate(World*, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    stream->store = mapStore(stream->storeFrames * sizeof(float));
+    stream->storeMapped = stream->store != nullptr;
+    
+    if (!stream->storeMapped) {
+        stream->store = static_cast<float*>(std::calloc(stream->storeFrames, sizeof(float)));
+    }
+    return true;
+}
+
+// RT
+bool GrainDelay::streamStart(World*, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    stream->ready = stream->store != nullptr;
+    
+    if (!stream->ready && stream->unit != nullptr) {
+        Print("GrainDelay: could not allocate the long delay line, grains beyond the recent samples read silence\n");
+    }
+    return false;
+}
+
+// NRT: copies the pages of one batch
+bool GrainDelay::streamTransfer(World*, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    
+    for (int k = 0; k < stream->numTransfers; ++k) {
+        const Stream::Transfer& transfer = stream->transfers[k];
+        float* page = stream->store + static_cast<size_t>(transfer.page) * LONG_PAGE_SIZE;
         
-        // 6. Output with wet/dry mix
-        output[i] = Utils::lerp(input[i], delayed, mix);
+        if (transfer.load) {
+            std::copy(page, page + LONG_PAGE_SIZE, transfer.samples);
+        } else {
+            std::copy(transfer.samples, transfer.samples + LONG_PAGE_SIZE, page);
+        }
+    }
+    return true;
+}
+
+// RT: loaded pages become readable, saved ones loadable
+bool GrainDelay::streamComplete(World*, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    
+    if (stream->unit != nullptr) {
+        stream->unit->completeTransfers();
+    }
+    return false;
+}
+
+// RT, after the last stage: sends the next batch, or releases the stream without the unit
+void GrainDelay::streamDone(World* world, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    stream->busy = false;
+    
+    if (stream->unit != nullptr) {
+        stream->unit->postTransfers();
+    } else {
+        releaseStream(world, stream);
+    }
+}
+
+// NRT
+bool GrainDelay::streamRelease(World*, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    
+    if (stream->storeMapped) {
+        unmapStore(stream->store, stream->storeFrames * sizeof(float));
+    } else {
+        std::free(stream->store);
+    }
+    stream->store = nullptr;
+    return false;
+}
+
+// RT
+void GrainDelay::streamFree(World* world, void* data) {
+    auto* stream = static_cast<Stream*>(data);
+    
+    if (stream->farMemory != nullptr) {
+        RTFree(world, stream->farMemory);
     }
+    RTFree(world, stream);
 }
 
+template <int MaxGrains>
 void GrainDelay::reset() {
-    m_eventSystem.reset();
-    m_writePos = 0;
+    // The wet signal has faded out: stop all grains and restart the trigger ramp
+    Voices<MaxGrains>& pool = voices<MaxGrains>();
+    pool.eventSystem.reset();
+    pool.numFadeTails = 0;
     m_dampingFilter.reset();
-    m_dcBlocker.reset();
+    m_resetFade = 1.0f;
+    m_resetFading = false;
     
-    // Reset grain data
-    for (int i = 0; i < NUM_CHANNELS; ++i) {
-        m_grainData[i] = GrainData{};  // Reset to default values
+    // An external Buffer belongs to the server and keeps its content. The internal line
+    // counts as silent from here on, and is zeroed a slice per block by advanceClear.
+    if (!m_external) {
+        m_clearing = true;
+        m_cleanLength = 0;
+        m_silentSamples = m_historyLength;
+    }
+    if (m_long) {
+        resetLongLine();
     }
 }
 
 PluginLoad(GrainDelayUGens) {
     ft = inTable;
+    s_windowTables.fill();
     registerUnit<GrainDelay>(ft, "GrainDelay", false);
+    registerUnit<GrainDelay>(ft, "GrainDelayPan", false);
+    DefineUnitCmd("GrainDelay", "stats", &GrainDelay::cmdStats);
+    DefineUnitCmd("GrainDelayPan", "stats", &GrainDelay::cmdStats);
+    DefineUnitCmd("GrainDelay", "save", &GrainDelay::cmdSave);
+    DefineUnitCmd("GrainDelayPan", "save", &GrainDelay::cmdSave);
+    DefineUnitCmd("GrainDelay", "load", &GrainDelay::cmdLoad);
+    DefineUnitCmd("GrainDelayPan", "load", &GrainDelay::cmdLoad);
+#ifdef GRAINDELAY_PROFILE
+    DefineUnitCmd("GrainDelay", "profile", &GrainDelay::cmdProfile);
+    DefineUnitCmd("GrainDelayPan", "profile", &GrainDelay::cmdProfile);
+#endif
+    registerGrainDelayBank(ft, s_windowTables);
 }
\ No newline at end of file
@@ -1,7 +1,7 @@
 #pragma once
 #include "SC_PlugIn.hpp"
 #include "Utils.hpp"
-#include <vector>
+#include <array>
 
 // ===== GRAIN DELAY =====
 
@@ -9,38 +9,374 @@ class GrainDelay : public SCUnit {
 public:
     GrainDelay();
     ~GrainDelay();
+    
+    // Unit command: replies to the node with the grain engine statistics
+    static void cmdStats(Unit* unit, sc_msg_iter* args);
+    
+    // Unit commands: write the internal delay line to a sound file or read one back
+    // into it. The file I/O runs on the non-realtime thread
+    static void cmdSave(Unit* unit, sc_msg_iter* args);
+    static void cmdLoad(Unit* unit, sc_msg_iter* args);
+    
+#ifdef GRAINDELAY_PROFILE
+    // Unit command: replies with the cycle counts of the calc function sections per
+    // block since the last query, then clears them
+    static void cmdProfile(Unit* unit, sc_msg_iter* args);
+#endif
 
 private:
-    void next_aa(int nSamples);
+    template <Utils::ParamRates Rates, int MaxGrains>
+    void next(int nSamples);
+    void next_silent(int nSamples);
+    
+    // Ends a reset once the wet signal has faded out, see next()
+    template <int MaxGrains>
     void reset();
+    void writeLine(int index, float value);
+    void zeroLine(int start, int count);
+    void copyLineOut(int start, float* samples, int count) const;
+    template <int MaxGrains>
+    void moveGrains(int offset);
+    void advanceClear(int numWritten);
+    void muteStaleReads(const float* phases, float* gains, int numSamples) const;
+    
+    // Long delay mode helpers, see Stream below
+    int wrapHistory(int position) const;
+    int currentLinePosition() const;
+    Utils::RingBuffer farRing(int ring) const;
+    int findPage(int page) const;
+    bool requestPages(int ring, int first, int last);
+    bool farPagesReady(int ring, int first, int last) const;
+    template <int MaxGrains>
+    void prefetchPages(float delayTime, float grainRate, float delayJitter, float rateJitter);
+    template <int MaxGrains>
+    void placeLongGrain(int slot, float delayTime);
+    bool muteMissingPages(int ring, int lineStart, int readStart, const float* phases, float* gains, int numSamples) const;
+    void advanceLongLine(int numSamples);
+    void completePage(int page, int written);
+    void resetLongLine();
+    bool queueTransfer(float* samples, int page, int slot, bool load);
+    void postTransfers();
+    void completeTransfers();
+    
+    // Allocates the voice pool and picks the calc function for a voice count
+    template <int MaxGrains>
+    bool initVoices();
+    
+    // Modulatable input for the current block, updates the stored control value
+    Utils::ParamSignal paramSignal(int index, float& lastValue, float lo, float hi);
+    
+    // Looks up the external Buffer for this block, false if it can't be used
+    bool bindExternalBuffer();
+    void releaseExternalBuffer();
+    
+    // Block rendering helpers
+    int wrapLine(int index) const;
+    template <int MaxGrains>
+    void startGrain(float overlap, float delayTime, float grainRate, const Utils::WindowTable& window, float pan, float spread, int stealMode, float delayJitter, float rateJitter);
+    template <int MaxGrains>
+    int stealVoice(int stealMode);
+    template <int MaxGrains>
+    int safeBlockLength(int maxLength) const;
+    int safeGrainLength(float readPos, float phase, float rate, int maxLength) const;
+    void accumulateGrain(Utils::InterpMode mode, int ring, const float* phases, const float* window, float* accum, int numSamples) const;
+    template <int MaxGrains>
+    bool renderGrain(int slot, int blockOffset, int numSamples);
+    template <int MaxGrains>
+    void renderGrains(int blockOffset, int numSamples);
+    template <int MaxGrains>
+    bool skipGrain(int slot, int numSamples);
+    template <int MaxGrains>
+    void skipGrains(int numSamples);
+    bool isIdle(const float* input, int numSamples) const;
+    float clipMaxDelayTime(float requested) const;
     
     // Constants cached at construction
     const float m_sampleRate;
     const float m_sampleDur;
-    const float m_bufFrames;
+    const float m_maxDelayTime;
+    const bool m_long;            // Long delay mode, m_buffer only holds the recent samples
     const int m_bufSize;
+    const float m_bufFrames;
+    const int m_numOutputs;
+    const bool m_external;
+    const Utils::LineFormat m_lineFormat;   // Float for external Buffers
+    const int m_maxGrains;
+    const float m_stealFadeStep;
+    const float m_resetFadeStep;
    
-    // Core trigger system
-    Utils::EventSystem m_eventSystem;
-
     // Constants
-    static constexpr int NUM_CHANNELS = 32;
-    static constexpr float MAX_DELAY_TIME = 5.0f;
-   
-    // Audio buffer and processing
-    std::vector<float> m_buffer;
+    static constexpr int MIN_GRAINS = 4;
+    static constexpr int MAX_GRAINS = 64;
+    static constexpr int KERNEL_BLOCK_SIZE = Utils::GrainCursor::KERNEL_SIZE;
+    static constexpr float DC_BLOCK_CUTOFF = 3.0f;
+    static constexpr float MIN_OVERLAP = 0.001f;
+    static constexpr float MIN_GRAIN_RATE = 0.125f;
+    static constexpr float MAX_GRAIN_RATE = 4.0f;
+    static constexpr float STEAL_FADE_TIME = 0.002f;
+    static constexpr int NUM_FADE_TAILS = 4;
+    static constexpr float MAX_RATE_JITTER = 2.0f;  // Octaves
+    static constexpr float RESET_FADE_TIME = 0.005f;
+    static constexpr int CLEAR_SLICE_SIZE = 4096;   // Samples of the line zeroed per block after a reset
+    static constexpr int SNAPSHOT_SLICE_SIZE = 4096; // Samples of the line saved or loaded per block, at least
+    static constexpr float MAX_DELAY_TIME = 60.0f;       // Line in RT memory
+    static constexpr float MAX_LONG_DELAY_TIME = 3600.0f;
+    static constexpr size_t MAX_LINE_FRAMES = size_t(1) << 30; // Either line, keeps the int index math in range
+    static constexpr float LONG_WINDOW_TIME = 1.5f;    // Recent samples kept in RT memory, at least
+    static constexpr float LONG_PREFETCH_TIME = 0.25f; // Reads loaded ahead of the grains, at most
+    static constexpr int LONG_PAGE_SIZE = 1024;        // Samples per page of a long line
+    static constexpr int LONG_RING_SIZE = 8192;        // Samples per far ring, eight pages
+    static constexpr int RING_PAGES = LONG_RING_SIZE / LONG_PAGE_SIZE;
+    static constexpr int MAX_PAGE_COPIES = 32;         // Pages the RT thread fills itself per block
+    static constexpr int STAGED_GRAINS = 4;            // Upcoming grains with a far ring filled ahead
+    
+    // Voice stealing policies when all voices are busy
+    enum StealModes {
+        StealDrop,      // Drop the new grain
+        StealOldest,    // Fade out the oldest grain
+        StealQuietest   // Fade out the grain with the lowest window gain
+    };
+
+    // Control-rate values of the modulatable inputs at the end of the previous block
+    float m_lastTriggerRate;
+    float m_lastOverlap;
+    float m_lastDelayTime;
+    float m_lastGrainRate;
+
+    // Audio buffer and processing (allocated from the RT pool). The line format picks
+    // which ring buffer m_lineMemory belongs to, the others stay empty.
+    void* m_lineMemory = nullptr;
+    Utils::RingBuffer m_buffer;
+    Utils::CompactRingBuffer<Utils::LineFormat::Int16> m_int16Buffer;
+    Utils::CompactRingBuffer<Utils::LineFormat::Half> m_halfBuffer;
     int m_writePos = 0;
+    
+    // Delay line used by the current block, the internal ring buffer
+    // or the server Buffer given by the bufnum input
+    SndBuf* m_sndBuf = nullptr;
+    float* m_lineData = nullptr;
+    int m_lineSize = 0;
+    float m_lineFrames = 0.0f;
+    float m_delayLimit = 0.0f;
+    bool m_lineWritable = true;
+    
+    // Consecutive silent samples written to the delay line, the whole internal
+    // line is silent once this reaches m_historyLength, its length or that of a long line
+    int m_silentSamples = 0;
+    int m_historyLength = 0;
+    
+    // Reset state. A reset fades the wet signal out, then all grains stop and the old
+    // content of the internal line is gone. The line is not zeroed in one go: while
+    // m_clearing, only the m_cleanLength samples behind the write head are written since
+    // the reset or already zeroed, reads of the rest are muted, and each block zeroes
+    // another slice of it.
+    float m_resetFade = 1.0f;      // Wet gain while a reset fades out
+    bool m_resetFading = false;
+    bool m_lastReset = false;
+    bool m_clearing = false;
+    int m_cleanLength = 0;
+    
+    // Interpolation of the grain reads for the current block
+    Utils::InterpMode m_interpMode = Utils::InterpMode::Cubic;
+    
+    // Per-block grain accumulator, one server block long (allocated from the RT pool)
+    float* m_grainBlock = nullptr;
+    
+    // Panned accumulators, one block per output (GrainDelayPan only)
+    float* m_panBlock = nullptr;
    
-    // Grain data structure
-    struct GrainData {
-        float readPos = 0.0f;
-        float rate = 1.0f; 
-        float phase = 0.0f;
-        bool hasTriggered = false;
+    // Voice pool sized by the maxGrains input, one slot index across all per-grain
+    // state. Slots 0..MaxGrains-1 are the voices handed out by the event system, the
+    // slots after them hold fade tails of stolen grains. The event system keeps the
+    // window timing (phase, slope, subsample offset), the arrays below the grain reads.
+    template <int MaxGrains>
+    struct Voices {
+        using Events = Utils::EventSystem<MaxGrains, NUM_FADE_TAILS>;
+        static constexpr int NUM_SLOTS = Events::numSlots;
+        
+        Events eventSystem;
+        alignas(64) std::array<float, NUM_SLOTS> readPos{};    // Normalized delay line position at onset
+        alignas(64) std::array<float, NUM_SLOTS> rate{};       // Playback rate
+        alignas(64) std::array<float, NUM_SLOTS> phase{};      // Samples read since onset
+        alignas(64) std::array<float, NUM_SLOTS> fade{};       // Fade-out gain of a stolen grain
+        alignas(64) std::array<float, NUM_SLOTS> fadeStep{};
+        std::array<int, NUM_SLOTS> lineStart{};                // Long line position at onset, -1 for grains reading m_buffer
+        std::array<int, NUM_SLOTS> ring{};                     // Far ring of the slot (long delay mode)
+        std::array<const Utils::WindowTable*, NUM_SLOTS> window{};  // Latched at grain onset
+        std::array<Utils::PanPosition, NUM_SLOTS> pan{};            // Output position (GrainDelayPan only)
+        
+        // All tail slots, the first numFadeTails fading and the rest free
+        std::array<int, NUM_FADE_TAILS> fadeTails{};
+        int numFadeTails = 0;
+        
+        void copySlot(int from, int to) {
+            eventSystem.channelPhases[to] = eventSystem.channelPhases[from];
+            eventSystem.channelSlopes[to] = eventSystem.channelSlopes[from];
+            eventSystem.channelOffsets[to] = eventSystem.channelOffsets[from];
+#ifdef GRAINDELAY_FLOAT_PHASE
+            eventSystem.channelAnchors[to] = eventSystem.channelAnchors[from];
+            eventSystem.channelElapsed[to] = eventSystem.channelElapsed[from];
+#endif
+            readPos[to] = readPos[from];
+            rate[to] = rate[from];
+            phase[to] = phase[from];
+            fade[to] = fade[from];
+            fadeStep[to] = fadeStep[from];
+            lineStart[to] = lineStart[from];
+            window[to] = window[from];
+            pan[to] = pan[from];
+            
+            // Far rings belong to a slot, the two slots trade theirs
+            std::swap(ring[to], ring[from]);
+        }
     };
-   
-    // grain voices
-    std::vector<GrainData> m_grainData;
+    
+    template <int MaxGrains>
+    Voices<MaxGrains>& voices() const {
+        return *static_cast<Voices<MaxGrains>*>(m_voices);
+    }
+    
+    // Voice pool (allocated from the RT pool, m_voices aligned for the slot arrays)
+    void* m_voicesMemory = nullptr;
+    void* m_voices = nullptr;
+    static constexpr size_t VOICES_ALIGNMENT = 64;
+    
+    // Grain engine statistics, reported and partly cleared by the stats command
+    struct GrainStats {
+        uint32 dropped = 0;            // Triggers dropped because all voices were busy
+        uint32 stolen = 0;             // Voices taken over from a playing grain
+        int active = 0;                // Voices active at the end of the last block
+        int peakActive = 0;            // Most simultaneous voices since the last query
+        uint32 startedSinceQuery = 0;  // Grains started since the last query
+        uint32 samplesSinceQuery = 0;  // Samples rendered since the last query
+        uint32 streamMisses = 0;       // Grains dropped or muted for a block because their pages weren't loaded
+    };
+    
+    GrainStats m_stats;
+    
+    void sendStats(int replyID);
+    
+#ifdef GRAINDELAY_PROFILE
+    Utils::Profile m_profile;
+    
+    void sendProfile(int replyID);
+#endif
+    
+    // One save or load of the internal delay line, allocated from the RT pool by the unit
+    // command. Its stages alternate between the non-realtime thread (file I/O, sample
+    // memory) and the unit, which copies from or to the line a slice per block, so the
+    // audio thread never touches the file system or the heap.
+    struct Snapshot {
+        static constexpr int PATH_LENGTH = 1024;
+        
+        GrainDelay* unit;          // Cleared by the destructor when the synth goes away first
+        bool load;
+        bool ok = false;
+        int replyID;
+        int lineSize;
+        Utils::LineFormat lineFormat;
+        float sampleRate;
+        float* samples = nullptr;  // Line unrolled oldest first (malloc, NRT thread only)
+        int frames = 0;
+        void* line = nullptr;      // Loaded line (RT pool), the unit's old line once swapped in
+        char path[PATH_LENGTH];
+        
+        // Set while the unit copies the line to save a slice per block, oldest first from head
+        bool copying = false;
+        int head = 0;
+        int cursor = 0;
+        int stale = 0;             // Oldest samples a reset had not cleared yet when the copy started
+    };
+    
+    // Snapshot command in flight, at most one per instance
+    Snapshot* m_snapshot = nullptr;
+    
+    void startSnapshot(bool load, const char* path, int replyID);
+    void advanceSnapshot(int numSamples);
+    void finishSnapshot();
+    void sendSnapshotReply(int replyID, bool load, bool ok);
+    static bool snapshotAllocate(World* world, void* data);
+    void swapLine(Snapshot* snapshot);
+    static bool snapshotRead(World* world, void* data);
+    static bool snapshotStart(World* world, void* data);
+    static bool snapshotDecode(World* world, void* data);
+    static bool snapshotWrite(World* world, void* data);
+    static bool snapshotRelease(World* world, void* data);
+    static void snapshotHandOver(World* world, void* data);
+    static void snapshotDone(World* world, void* data);
+    
+    // Long delay mode. The whole line lives in 'store', a memory-mapped temporary file that
+    // only the non-realtime thread touches, in pages of LONG_PAGE_SIZE samples. m_buffer
+    // holds the recent samples, written by the head as usual. A grain reading further back reads its
+    // voice's far ring, LONG_RING_SIZE samples of the line around its read position, and
+    // more rings are filled for the next grains, which take them over as they start. Page
+    // p of the line lands at the same position in every ring, so a ring is read like
+    // m_buffer. Every block requests the pages the grains read next; the RT thread copies
+    // a page it finds in another ring or in m_buffer, or zeroes a silent one, and the
+    // others are copied between the store and the rings in batches on the non-realtime
+    // thread, at most one batch in flight. The stream is allocated from the RT pool and
+    // outlives the unit until that batch is done.
+    struct Stream {
+        struct Transfer {
+            float* samples;        // Page in a far ring for loads, a staging page for saves
+            int page;
+            int slot;              // Far slot of a load, staging page of a save
+            uint32 generation;     // Resets since construction, transfers queued before a reset are ignored
+            bool load;
+        };
+        static constexpr int MAX_TRANSFERS = 128;
+        static constexpr int SAVE_PAGES = 64;
+        
+        GrainDelay* unit;          // Cleared by the destructor when the synth goes away first
+        float* store = nullptr;    // The whole line (NRT thread only)
+        size_t storeFrames = 0;
+        bool storeMapped = false;  // store maps a temporary file, calloc'd otherwise
+        void* farMemory = nullptr; // The unit's far rings, handed over by the destructor
+        bool ready = false;        // The store is allocated
+        bool busy = false;         // A command is in flight
+        int numQueued = 0;         // Waiting for the next batch (RT only)
+        Transfer queued[MAX_TRANSFERS];
+        int numTransfers = 0;      // The batch in flight
+        Transfer transfers[MAX_TRANSFERS];
+        
+        // Finished pages are copied out of m_buffer when queued, the head laps or a clear
+        // zeroes the ring while a save waits for the NRT thread
+        int numFreePages = 0;      // Staging pages not held by a save (RT only)
+        int freePages[SAVE_PAGES];
+        float savePages[SAVE_PAGES][LONG_PAGE_SIZE];
+    };
+    
+    // One page of a far ring, RING_PAGES slots per ring
+    struct FarSlot {
+        int page = -1;             // Page of the long line in the slot, -1 if none
+        bool loading = false;      // A transfer fills the slot, nothing reads or reassigns it
+        bool ready = false;
+    };
+    
+    Stream* m_stream = nullptr;
+    void* m_farMemory = nullptr;   // The far rings, one after the other
+    void* m_tableMemory = nullptr;
+    FarSlot* m_farSlots = nullptr;
+    uint8* m_pageStored = nullptr; // Per page: the store holds its content, silent otherwise
+    int m_numRings = 0;            // One per voice slot and per staged grain
+    int m_stagingRings[STAGED_GRAINS] = {}; // Filled for the next grains, in order
+    int m_numPages = 0;
+    int m_linePosition = 0;        // Write head on the long line at the start of the block
+    int m_recentLimit = 0;         // Reads up to this far behind the head use m_buffer
+    int m_prefetchSamples = 0;
+    int m_pageCopies = 0;          // Pages filled by the RT thread this block
+    uint32 m_streamGeneration = 0;
+    float m_delayDraws[STAGED_GRAINS] = {}; // Delay jitter of the next grains, drawn ahead so their pages can load
+    bool m_delayDrawn = false;
+    
+    static void releaseStream(World* world, Stream* stream);
+    static bool streamAllocate(World* world, void* data);
+    static bool streamStart(World* world, void* data);
+    static bool streamTransfer(World* world, void* data);
+    static bool streamComplete(World* world, void* data);
+    static void streamDone(World* world, void* data);
+    static bool streamRelease(World* world, void* data);
+    static void streamFree(World* world, void* data);
    
     // Feedback processing filters
     Utils::OnePoleNormalized m_dampingFilter;  // For feedback damping (0-1)
@@ -49,18 +385,31 @@ private:
     // Input parameters for audio processing
     enum InputParams {
         Input,          // Audio input
-        TriggerRate,    // Grain trigger rate (Hz) - density control
-        Overlap,        // Grain overlap amount  
-        DelayTime,      // Delay time in seconds
-        GrainRate,      // Grain playback rate (0.5-2.0, 1.0=normal)
+        TriggerRate,    // Grain trigger rate (Hz) - density control (audio or control rate)
+        Overlap,        // Grain overlap amount (audio or control rate)
+        DelayTime,      // Delay time in seconds (audio or control rate)
+        GrainRate,      // Grain playback rate (0.5-2.0, 1.0=normal, audio or control rate)
         Mix,            // Wet/dry mix (0=dry, 1=wet)
         Feedback,       // Feedback amount (0-0.95)
         Damping,        // Feedback filter (0=dark, 1=bright)
         Freeze,         // Freeze buffer (0=record, 1=freeze)
-        Reset          // Reset trigger
+        Reset,          // Reset trigger
+        MaxDelayTime,   // Maximum delay time in seconds (init-rate)
+        WindowType,     // Grain window (0=Hann, 1=Tukey, 2=Welch, 3=exponential decay)
+        Pan,            // Pan center across the outputs (-1 to 1, GrainDelayPan only)
+        Spread,         // Random per-grain pan spread (0-1, GrainDelayPan only)
+        BufNum,         // External mono Buffer used as the delay line (-1 = internal buffer, init-rate mode)
+        ReadOnly,       // Only read the external Buffer, never write it (0 = read-write, 1 = read-only)
+        MaxGrains,      // Maximum number of simultaneous grains (init-rate, rounded up to 4, 8, 16, 32 or 64)
+        StealMode,      // With all voices busy: 0 = drop the trigger, 1 = steal the oldest, 2 = steal the quietest
+        Interpolation,  // Grain read interpolation (0 = none, 1 = linear, 2 = cubic, 3 = 6-point Hermite)
+        DelayJitter,    // Random per-grain delay scatter, fraction of delayTime (0-1)
+        RateJitter,     // Random per-grain rate scatter in octaves (0-2)
+        LineFormat,     // Internal delay line samples (init-rate, 0 = float, 1 = 16-bit integer, 2 = half float)
+        LongDelay       // Keep the internal line in non-realtime memory (init-rate, 0 = off, 1 = on)
     };
    
     enum Outputs {
-        Output        
+        Output          // First output, GrainDelayPan has numChannels outputs
     };
 };
\ No newline at end of file
@@ -1,14 +1,54 @@
 GrainDelay : UGen {
 	*ar { |input = 0, triggerRate = 10, overlap = 1, 
 		delayTime = 0.2, grainRate = 1.0, mix = 0.5, 
-		feedback = 0.3, damping = 0.7, freeze = 0, reset = 0|
-		
-		if(triggerRate.rate != 'audio') { triggerRate = K2A.ar(triggerRate) };
-		if(overlap.rate != 'audio') { overlap = K2A.ar(overlap) };
-		if(delayTime.rate != 'audio') { delayTime = K2A.ar(delayTime) };
-		if(grainRate.rate != 'audio') { grainRate = K2A.ar(grainRate) };
+		feedback = 0.3, damping = 0.7, freeze = 0, reset = 0, maxDelayTime = 5, windowType = 0,
+		bufnum = -1, readOnly = 0, maxGrains = 32, stealMode = 0,
+		interpolation = 2, delayJitter = 0, rateJitter = 0, lineFormat = 0, longDelay = 0|
 		
+		// pan and spread only apply to GrainDelayPan
 		^this.multiNew('audio', input, triggerRate, overlap, 
-			delayTime, grainRate, mix, feedback, damping, freeze, reset)
+			delayTime, grainRate, mix, feedback, damping, freeze, reset, maxDelayTime, windowType, 0, 0,
+			bufnum, readOnly, maxGrains, stealMode, interpolation, delayJitter, rateJitter, lineFormat, longDelay)
+	}
+}
+
+GrainDelayPan : MultiOutUGen {
+	*ar { |numChannels = 2, input = 0, triggerRate = 10, overlap = 1, 
+		delayTime = 0.2, grainRate = 1.0, mix = 0.5, 
+		feedback = 0.3, damping = 0.7, freeze = 0, reset = 0, maxDelayTime = 5, windowType = 0,
+		pan = 0, spread = 1, bufnum = -1, readOnly = 0, maxGrains = 32, stealMode = 0, interpolation = 2,
+		delayJitter = 0, rateJitter = 0, lineFormat = 0, longDelay = 0|
+		
+		^this.multiNew('audio', numChannels, input, triggerRate, overlap, 
+			delayTime, grainRate, mix, feedback, damping, freeze, reset, maxDelayTime, windowType, pan, spread,
+			bufnum, readOnly, maxGrains, stealMode, interpolation, delayJitter, rateJitter, lineFormat, longDelay)
+	}
+	
+	init { |argNumChannels ... theInputs|
+		inputs = theInputs;
+		^this.initOutputs(argNumChannels, rate)
+	}
+	
+	argNamesInputsOffset { ^2 }
+}
+
+GrainDelayBank : MultiOutUGen {
+	*ar { |input = 0, triggerRate = 10, overlap = 1, 
+		delayTime = 0.2, grainRate = 1.0, mix = 0.5, 
+		feedback = 0.3, damping = 0.7, freeze = 0, reset = 0, maxDelayTime = 1, windowType = 0,
+		maxGrains = 16, interpolation = 2, delayJitter = 0, rateJitter = 0|
+		
+		// One lane per input channel, triggerRate, delayTime and grainRate take one value per lane or one for all
+		var lanes = input.asArray.collect { |sig, i|
+			[sig, triggerRate.asArray.wrapAt(i), delayTime.asArray.wrapAt(i), grainRate.asArray.wrapAt(i)]
+		};
+		
+		^this.multiNewList(['audio', lanes.size, overlap, mix, feedback, damping, freeze, reset,
+			maxDelayTime, windowType, maxGrains, interpolation, delayJitter, rateJitter] ++ lanes.flat)
+	}
+	
+	init { |numLanes ... theInputs|
+		inputs = theInputs;
+		^this.initOutputs(numLanes, rate)
 	}
 }
\ No newline at end of file
@@ -0,0 +1,612 @@
+#include "GrainDelayBank.hpp"
+#include "SC_PlugIn.hpp"
+#include <limits>
+#include <memory>
+#include <new>
+
+static InterfaceTable* ft;
+
+// Window tables of the plugin, filled before the unit is registered
+static const Utils::WindowTables* s_windowTables = nullptr;
+
+// ===== GRAIN DELAY BANK =====
+
+GrainDelayBank::GrainDelayBank() :
+    m_sampleRate(static_cast<float>(sampleRate())),
+    m_sampleDur(static_cast<float>(sampleDur())),
+    m_numLanes(std::max(0, (static_cast<int>(numInputs()) - NumSharedInputs) / NumLaneInputs)),
+    m_numPaddedLanes((m_numLanes + LANE_ALIGNMENT - 1) / LANE_ALIGNMENT * LANE_ALIGNMENT),
+    m_minDelayTime(static_cast<float>(bufferSize() + 4) * m_sampleDur),
+    m_maxDelayTime(sc_clip(in0(MaxDelayTime), m_minDelayTime, std::min(MAX_DELAY_TIME, static_cast<float>(MAX_LINE_FRAMES) / m_sampleRate))),
+    m_bufSize(static_cast<int>(Utils::nextPowerOfTwo(static_cast<size_t>(std::ceil(m_maxDelayTime * m_sampleRate)) + 4))),
+    m_bufFrames(static_cast<float>(m_bufSize)),
+    m_maxGrains(Utils::nextPowerOfTwo(sc_clip(static_cast<int>(std::ceil(in0(GrainsPerLane))), MIN_GRAINS, MAX_GRAINS))),
+    m_resetFadeStep(-1.0f / std::max(1.0f, RESET_FADE_TIME * m_sampleRate)),
+    m_lastOverlap(sc_clip(in0(Overlap), MIN_OVERLAP, static_cast<float>(m_maxGrains)))
+{
+    if (m_numLanes == 0 || static_cast<int>(numOutputs()) != m_numLanes) {
+        Print("GrainDelayBank: needs one output per lane\n");
+        mCalcFunc = make_calc_function<GrainDelayBank, &GrainDelayBank::next_silent>();
+        next_silent(1);
+        return;
+    }
+    
+    if (in0(MaxDelayTime) > m_maxDelayTime) {
+        Print("GrainDelayBank: maxDelayTime %g s clipped to %g s\n", in0(MaxDelayTime), m_maxDelayTime);
+    }
+    
+    // Delay lines, filter states and block buffers from the real-time pool,
+    // whatever was allocated is released in the destructor. A line pool too
+    // large to address is never requested and fails like a full pool.
+    const size_t laneFloats = static_cast<size_t>(Utils::RingBuffer::allocationSize(m_bufSize));
+    const size_t lineFloats = static_cast<size_t>(m_numLanes) * laneFloats;
+    
+    if (static_cast<size_t>(m_numLanes) <= std::numeric_limits<size_t>::max() / sizeof(float) / laneFloats) {
+        m_lineMemory = static_cast<float*>(RTAlloc(mWorld, lineFloats * sizeof(float)));
+    }
+    
+    const size_t rowFloats = static_cast<size_t>(bufferSize()) * m_numPaddedLanes;
+    const size_t workFloats = 2 * m_numPaddedLanes + 4 * rowFloats + static_cast<size_t>(m_numLanes) * bufferSize();
+    m_workMemory = RTAlloc(mWorld, workFloats * sizeof(float) + MEMORY_ALIGNMENT);
+    
+    // The voice count selects a calc function with fixed-size voice loops
+    bool lanesAllocated = false;
+    
+    switch (m_maxGrains) {
+        case 4: lanesAllocated = initLanes<4>(); break;
+        case 8: lanesAllocated = initLanes<8>(); break;
+        case 16: lanesAllocated = initLanes<16>(); break;
+        default: lanesAllocated = initLanes<32>(); break;
+    }
+    
+    if (m_lineMemory == nullptr || m_workMemory == nullptr || !lanesAllocated) {
+        Print("GrainDelayBank: RT memory allocation failed, try increasing the real-time memory size in the server options\n");
+        mCalcFunc = make_calc_function<GrainDelayBank, &GrainDelayBank::next_silent>();
+        next_silent(1);
+        return;
+    }
+    
+    std::fill(m_lineMemory, m_lineMemory + lineFloats, 0.0f);
+    
+    // Carve the aligned work memory, padding lanes stay at zero throughout
+    void* aligned = m_workMemory;
+    size_t space = workFloats * sizeof(float) + MEMORY_ALIGNMENT;
+    float* work = static_cast<float*>(std::align(MEMORY_ALIGNMENT, workFloats * sizeof(float), aligned, space));
+    std::fill(work, work + workFloats, 0.0f);
+    
+    m_dampState = work;
+    m_dcState = m_dampState + m_numPaddedLanes;
+    m_dryRows = m_dcState + m_numPaddedLanes;
+    m_wetRows = m_dryRows + rowFloats;
+    m_outRows = m_wetRows + rowFloats;
+    m_writeRows = m_outRows + rowFloats;
+    m_grainBlocks = m_writeRows + rowFloats;
+    
+    m_dcBlocker.setCutoff(DC_BLOCK_CUTOFF, m_sampleRate);
+    (mCalcFunc)(this, 1);
+}
+
+template <int MaxGrains>
+bool GrainDelayBank::initLanes() {
+    // RTAlloc only guarantees malloc alignment, over-allocate and align the pool by hand
+    const size_t poolSize = static_cast<size_t>(m_numLanes) * sizeof(Lane<MaxGrains>);
+    m_laneMemory = RTAlloc(mWorld, poolSize + MEMORY_ALIGNMENT);
+    
+    if (m_laneMemory == nullptr) {
+        return false;
+    }
+    
+    void* aligned = m_laneMemory;
+    size_t space = poolSize + MEMORY_ALIGNMENT;
+    m_lanes = std::align(MEMORY_ALIGNMENT, poolSize, aligned, space);
+    
+    // The internal lines start silent, like the line of GrainDelay
+    for (int k = 0; k < m_numLanes; ++k) {
+        Lane<MaxGrains>& state = *new (&lane<MaxGrains>(k)) Lane<MaxGrains>();
+        state.lastTriggerRate = in0(laneInput(k, LaneTriggerRate));
+        state.lastDelayTime = sc_clip(in0(laneInput(k, LaneDelayTime)), m_minDelayTime, m_maxDelayTime);
+        state.lastGrainRate = sc_clip(in0(laneInput(k, LaneGrainRate)), MIN_GRAIN_RATE, MAX_GRAIN_RATE);
+        state.silentSamples = m_bufSize;
+    }
+    
+    mCalcFunc = make_calc_function<GrainDelayBank, &GrainDelayBank::next<MaxGrains>>();
+    return true;
+}
+
+GrainDelayBank::~GrainDelayBank() {
+    if (m_lineMemory != nullptr) {
+        RTFree(mWorld, m_lineMemory);
+    }
+    if (m_workMemory != nullptr) {
+        RTFree(mWorld, m_workMemory);
+    }
+    if (m_laneMemory != nullptr) {
+        RTFree(mWorld, m_laneMemory);
+    }
+}
+
+void GrainDelayBank::next_silent(int nSamples) {
+    ClearUnitOutputs(this, nSamples);
+}
+
+Utils::ParamSignal GrainDelayBank::paramSignal(int index, float& lastValue, float lo, float hi) {
+    const float next = sc_clip(in0(index), lo, hi);
+    Utils::ParamSignal signal{nullptr, lastValue, calcSlope(next, lastValue), lo, hi};
+    lastValue = next;
+    return signal;
+}
+
+template <int MaxGrains>
+void GrainDelayBank::startGrain(Lane<MaxGrains>& lane, int writeHead, float overlap, float delayTime, float grainRate, const Utils::WindowTable& window, float delayJitter, float rateJitter) {
+    const int g = lane.eventSystem.startChannel(overlap);
+    
+    // All voices of the lane busy: drop the grain
+    if (g < 0) {
+        return;
+    }
+    
+    // Jitter is drawn once per grain, the RNG is only touched when it is enabled
+    RGen& rgen = *mParent->mRGen;
+    
+    if (delayJitter > 0.0f) {
+        delayTime = sc_clip(delayTime * (1.0f + delayJitter * rgen.frand2()), m_minDelayTime, m_maxDelayTime);
+    }
+    if (rateJitter > 0.0f) {
+        grainRate = sc_clip(grainRate * std::exp2(rateJitter * rgen.frand2()), MIN_GRAIN_RATE, MAX_GRAIN_RATE);
+    }
+    
+    lane.readOffset[g] = sc_wrap(static_cast<float>(writeHead) - delayTime * m_sampleRate, 0.0f, m_bufFrames);
+    lane.rate[g] = grainRate;
+    lane.phase[g] = grainRate * static_cast<float>(lane.eventSystem.channelOffsets[g]);
+    lane.window[g] = &window;
+}
+
+static void accumulateGrain(Utils::InterpMode mode, const Utils::RingBuffer& line, const float* phases, const float* window, float* accum, int numSamples) {
+    using Utils::InterpMode;
+    
+    switch (mode) {
+        case InterpMode::None: Utils::accumulateWindowed<InterpMode::None>(line, phases, window, accum, numSamples); break;
+        case InterpMode::Linear: Utils::accumulateWindowed<InterpMode::Linear>(line, phases, window, accum, numSamples); break;
+        case InterpMode::Hermite6: Utils::accumulateWindowed<InterpMode::Hermite6>(line, phases, window, accum, numSamples); break;
+        default: Utils::accumulateWindowed<InterpMode::Cubic>(line, phases, window, accum, numSamples); break;
+    }
+}
+
+template <int MaxGrains>
+void GrainDelayBank::renderGrains(Lane<MaxGrains>& lane, const Utils::RingBuffer& line, float* accum, int segmentStart, int numSamples, int writeLength) {
+    constexpr int KERNEL_SIZE = Utils::GrainCursor::KERNEL_SIZE;
+    typename Lane<MaxGrains>::Events& eventSystem = lane.eventSystem;
+    int k = 0;
+    
+    while (k < eventSystem.numActive) {
+        const int ch = eventSystem.activeChannels[k];
+        
+        // Deferred grains are finished after the writes
+        if (lane.deferred[ch]) {
+            ++k;
+            continue;
+        }
+        
+        Utils::GrainCursor grain(eventSystem, ch, *lane.window[ch], lane.readOffset[ch], lane.rate[ch], lane.phase[ch]);
+        bool active = true;
+        
+        // Whole-sample reads at unity rate are exact without interpolation
+        const bool aligned = grain.rate == 1.0f && grain.readOffset == std::floor(grain.readOffset) && grain.phase == std::floor(grain.phase);
+        const Utils::InterpMode interpMode = aligned ? Utils::InterpMode::None : m_interpMode;
+        
+        // Render only the samples that read what was written before this block
+        const int length = writeLength > 0 ? safeGrainLength(grain.readOffset, grain.phase, grain.rate, writeLength, numSamples) : numSamples;
+        
+        float phases[KERNEL_SIZE];
+        float window[KERNEL_SIZE];
+        int offset = 0;
+        
+        while (active && offset < length) {
+            const int count = std::min(KERNEL_SIZE, length - offset);
+            const int n = grain.fill(phases, window, count);
+            active = n == count;
+            
+            if (lane.clearing) {
+                muteStaleReads(phases, window, n, m_writePos, lane.cleanLength);
+            }
+            accumulateGrain(interpMode, line, phases, window, accum + offset, n);
+            offset += n;
+        }
+        
+        grain.store(eventSystem, ch);
+        lane.phase[ch] = grain.phase;
+        
+        if (!active) {
+            eventSystem.releaseActive(k);
+            continue;
+        }
+        if (length < numSamples) {
+            lane.deferred[ch] = true;
+            lane.deferredFrom[ch] = segmentStart + length;
+            lane.deferredChannels[lane.numDeferred++] = ch;
+        }
+        ++k;
+    }
+}
+
+template <int MaxGrains>
+void GrainDelayBank::renderDeferred(Lane<MaxGrains>& lane, const Utils::RingBuffer& line, float* accum, int sample) {
+    // One sample of every deferred grain due, reading the line as written up to the sample before
+    typename Lane<MaxGrains>::Events& eventSystem = lane.eventSystem;
+    int d = 0;
+    
+    while (d < lane.numDeferred) {
+        const int ch = lane.deferredChannels[d];
+        
+        if (lane.deferredFrom[ch] > sample) {
+            ++d;
+            continue;
+        }
+        
+        Utils::GrainCursor grain(eventSystem, ch, *lane.window[ch], lane.readOffset[ch], lane.rate[ch], lane.phase[ch]);
+        const bool aligned = grain.rate == 1.0f && grain.readOffset == std::floor(grain.readOffset) && grain.phase == std::floor(grain.phase);
+        const Utils::InterpMode interpMode = aligned ? Utils::InterpMode::None : m_interpMode;
+        
+        float phase;
+        float window;
+        const int n = grain.fill(&phase, &window, 1);
+        
+        if (lane.clearing) {
+            muteStaleReads(&phase, &window, n, line.wrap(m_writePos + sample), std::min(m_bufSize, lane.cleanLength + sample));
+        }
+        accumulateGrain(interpMode, line, &phase, &window, accum, n);
+        
+        grain.store(eventSystem, ch);
+        lane.phase[ch] = grain.phase;
+        
+        if (n == 1) {
+            ++d;
+            continue;
+        }
+        
+        // The window has ended
+        lane.deferred[ch] = false;
+        lane.deferredChannels[d] = lane.deferredChannels[--lane.numDeferred];
+        
+        for (int k = 0; k < eventSystem.numActive; ++k) {
+            if (eventSystem.activeChannels[k] == ch) {
+                eventSystem.releaseActive(k);
+                break;
+            }
+        }
+    }
+}
+
+int GrainDelayBank::safeGrainLength(float readOffset, float phase, float rate, int writeLength, int maxLength) const {
+    // Lowest tap of the widest interpolator. A grain with a tap in the samples this block
+    // writes waits for them, otherwise it renders until its highest tap would reach them
+    // (rounding headroom of 1/16 sample per step), as GrainDelay::safeGrainLength does.
+    const int mask = m_bufSize - 1;
+    const int firstTap = static_cast<int>(readOffset + phase) - 2;
+    
+    if (((firstTap + 5 - m_writePos) & mask) < writeLength + 5) {
+        return 0;
+    }
+    
+    const float steps = static_cast<float>((m_writePos - firstTap - 6) & mask) / (rate + 0.0625f);
+    return steps < static_cast<float>(maxLength) ? static_cast<int>(steps) : maxLength;
+}
+
+void GrainDelayBank::muteStaleReads(const float* phases, float* gains, int numSamples, int writeHead, int cleanLength) const {
+    // As GrainDelay::muteStaleReads, for a line whose clean part ends at writeHead
+    const int mask = m_bufSize - 1;
+    
+    for (int i = 0; i < numSamples; ++i) {
+        const int distance = (writeHead - static_cast<int>(phases[i])) & mask;
+        
+        if (distance < 4 || distance + 2 > cleanLength) {
+            gains[i] = 0.0f;
+        }
+    }
+}
+
+template <int MaxGrains>
+void GrainDelayBank::advanceClear(Lane<MaxGrains>& lane, int index, int numWritten) {
+    // Samples written this block are clean, then the slice just behind the clean part is zeroed
+    lane.cleanLength = std::min(m_bufSize, lane.cleanLength + numWritten);
+    
+    Utils::RingBuffer laneLine = line(index);
+    const int count = std::min(CLEAR_SLICE_SIZE, m_bufSize - lane.cleanLength);
+    const int start = laneLine.wrap(m_writePos - lane.cleanLength - count);
+    const int firstPart = std::min(count, m_bufSize - start);
+    std::fill_n(laneLine.data + start, firstPart, 0.0f);
+    std::fill_n(laneLine.data, count - firstPart, 0.0f);
+    laneLine.updateGuard();
+    
+    lane.cleanLength += count;
+    lane.clearing = lane.cleanLength < m_bufSize;
+}
+
+template <int MaxGrains>
+void GrainDelayBank::resetLanes() {
+    // The wet signals have faded out: stop all grains and restart the trigger ramps. A lane
+    // whose line is silent already has nothing to clear, the others count as silent from
+    // here on and are zeroed by advanceClear.
+    for (int k = 0; k < m_numLanes; ++k) {
+        Lane<MaxGrains>& state = lane<MaxGrains>(k);
+        state.eventSystem.reset();
+        m_dampState[k] = 0.0f;
+        
+        if (state.clearing || state.silentSamples < m_bufSize) {
+            state.clearing = true;
+            state.cleanLength = 0;
+            state.silentSamples = m_bufSize;
+        }
+    }
+    m_resetFade = 1.0f;
+    m_resetFading = false;
+}
+
+template <int MaxGrains>
+void GrainDelayBank::skipGrains(Lane<MaxGrains>& lane, int numSamples) {
+    // Moves the grains of an idle lane on as renderGrains does, without reading the line
+    constexpr int KERNEL_SIZE = Utils::GrainCursor::KERNEL_SIZE;
+    typename Lane<MaxGrains>::Events& eventSystem = lane.eventSystem;
+    int k = 0;
+    
+    while (k < eventSystem.numActive) {
+        const int ch = eventSystem.activeChannels[k];
+        Utils::GrainCursor grain(eventSystem, ch, *lane.window[ch], lane.readOffset[ch], lane.rate[ch], lane.phase[ch]);
+        bool active = true;
+        
+        float phases[KERNEL_SIZE];
+        float window[KERNEL_SIZE];
+        int offset = 0;
+        
+        while (active && offset < numSamples) {
+            const int count = std::min(KERNEL_SIZE, numSamples - offset);
+            const int n = grain.fill(phases, window, count);
+            active = n == count;
+            offset += n;
+        }
+        
+        grain.store(eventSystem, ch);
+        lane.phase[ch] = grain.phase;
+        
+        if (active) {
+            ++k;
+        } else {
+            eventSystem.releaseActive(k);
+        }
+    }
+}
+
+template <int MaxGrains>
+bool GrainDelayBank::isLaneIdle(int index, const float* input, int numSamples) const {
+    if (lane<MaxGrains>(index).silentSamples < m_bufSize || m_dampState[index] != 0.0f || m_dcState[index] != 0.0f) {
+        return false;
+    }
+    
+    for (int i = 0; i < numSamples; ++i) {
+        if (input[i] != 0.0f) {
+            return false;
+        }
+    }
+    return true;
+}
+
+template <int MaxGrains>
+void GrainDelayBank::writeLines(int offset, int numSamples) {
+    // Rows [offset, offset + numSamples) of the block into every line. An idle lane would
+    // write zeros into a line that is silent already.
+    const int stride = m_numPaddedLanes;
+    
+    for (int k = 0; k < m_numLanes; ++k) {
+        Lane<MaxGrains>& state = lane<MaxGrains>(k);
+        
+        Utils::RingBuffer laneLine = line(k);
+        int writePos = laneLine.wrap(m_writePos + offset);
+        
+        // The line is only logically silent while a clear runs, the head zeroes what it passes
+        if (state.idle) {
+            for (int i = 0; state.clearing && i < numSamples; ++i) {
+                laneLine.write(writePos, 0.0f);
+                writePos = laneLine.wrap(writePos + 1);
+            }
+            continue;
+        }
+        
+        for (int i = offset; i < offset + numSamples; ++i) {
+            const float value = m_writeRows[i * stride + k];
+            state.silentSamples = value == 0.0f ? std::min(state.silentSamples + 1, m_bufSize) : 0;
+            laneLine.write(writePos, value);
+            writePos = laneLine.wrap(writePos + 1);
+        }
+    }
+}
+
+template <int MaxGrains>
+void GrainDelayBank::next(int nSamples) {
+    const int numLanes = m_numLanes;
+    const int stride = m_numPaddedLanes;
+    const int blockSize = bufferSize();
+    
+    // Shared parameters, overlap ramped across the block
+    const float startOverlap = m_lastOverlap;
+    const Utils::ParamSignal overlap = paramSignal(Overlap, m_lastOverlap, MIN_OVERLAP, static_cast<float>(MaxGrains));
+    const float gainStart = Utils::overlapCompensation(startOverlap);
+    const float gainStep = calcSlope(Utils::overlapCompensation(m_lastOverlap), gainStart);
+    
+    const float mix = sc_clip(in0(Mix), 0.0f, 1.0f);
+    const float feedback = sc_clip(in0(Feedback), 0.0f, 0.99f);
+    const float damping = sc_clip(in0(Damping), 0.0f, 1.0f);
+    const bool freeze = in0(Freeze) > 0.5f;
+    const bool reset = in0(Reset) > 0.5f;
+    const Utils::WindowTable& window = s_windowTables->get(static_cast<int>(in0(WindowType)));
+    const float delayJitter = sc_clip(in0(DelayJitter), 0.0f, 1.0f);
+    const float rateJitter = sc_clip(in0(RateJitter), 0.0f, MAX_RATE_JITTER);
+    m_interpMode = static_cast<Utils::InterpMode>(sc_clip(static_cast<int>(in0(Interpolation)), 0, static_cast<int>(Utils::InterpMode::NumModes) - 1));
+    
+    constexpr float maxRate = std::numeric_limits<float>::max();
+    constexpr auto Rates = Utils::ParamRates::Control;
+    
+    // A reset trigger fades the wet signals out over RESET_FADE_TIME, no new grains start
+    // until they have faded and the reset input is released
+    if (reset && !m_lastReset) {
+        m_resetFading = true;
+    }
+    m_lastReset = reset;
+    
+    const bool triggering = !reset && !m_resetFading;
+    
+    // 1. Render the grains of each lane across the whole block. The shortest delay is one
+    // block, so grains read only what was written before this block while they start, and
+    // the lines are written after all lanes are rendered. A grain that catches up with the
+    // samples this block writes is deferred from that sample on.
+    const int writeLength = freeze ? 0 : nSamples;
+    bool anyDeferred = false;
+    
+    for (int k = 0; k < numLanes; ++k) {
+        Lane<MaxGrains>& state = lane<MaxGrains>(k);
+        const float* input = in(laneInput(k, LaneInput));
+        float* accum = m_grainBlocks + k * blockSize;
+        std::fill(accum, accum + nSamples, 0.0f);
+        
+        const Utils::ParamSignal triggerRate = paramSignal(laneInput(k, LaneTriggerRate), state.lastTriggerRate, -maxRate, maxRate);
+        const Utils::ParamSignal delayTime = paramSignal(laneInput(k, LaneDelayTime), state.lastDelayTime, m_minDelayTime, m_maxDelayTime);
+        const Utils::ParamSignal grainRate = paramSignal(laneInput(k, LaneGrainRate), state.lastGrainRate, MIN_GRAIN_RATE, MAX_GRAIN_RATE);
+        typename Lane<MaxGrains>::Events& eventSystem = state.eventSystem;
+        
+        // A silent lane starts and moves its grains without reading, as an idle GrainDelay does
+        state.idle = triggering && isLaneIdle<MaxGrains>(k, input, nSamples);
+        
+        const Utils::RingBuffer laneLine = line(k);
+        int nextTrigger = triggering ? eventSystem.template nextTrigger<Rates>(triggerRate, m_sampleRate, 0, nSamples) : nSamples;
+        int segmentStart = 0;
+        
+        while (segmentStart < nSamples) {
+            if (nextTrigger == segmentStart) {
+                const int writeHead = freeze ? m_writePos : laneLine.wrap(m_writePos + segmentStart);
+                startGrain<MaxGrains>(
+                    state,
+                    writeHead,
+                    overlap.at<Rates>(segmentStart),
+                    delayTime.at<Rates>(segmentStart),
+                    grainRate.at<Rates>(segmentStart),
+                    window,
+                    delayJitter,
+                    rateJitter
+                );
+                nextTrigger = eventSystem.template nextTrigger<Rates>(triggerRate, m_sampleRate, segmentStart + 1, nSamples);
+            }
+            
+            if (state.idle) {
+                skipGrains<MaxGrains>(state, nextTrigger - segmentStart);
+            } else {
+                renderGrains<MaxGrains>(state, laneLine, accum + segmentStart, segmentStart, nextTrigger - segmentStart, writeLength);
+            }
+            segmentStart = nextTrigger;
+        }
+        
+        anyDeferred = anyDeferred || state.numDeferred > 0;
+    }
+    
+    // 2. Interleave inputs and grain sums by sample. Every input is read before any
+    // output is written, since outputs may share the buffers of inputs.
+    for (int k = 0; k < numLanes; ++k) {
+        const float* input = in(laneInput(k, LaneInput));
+        const float* accum = m_grainBlocks + k * blockSize;
+        
+        for (int i = 0; i < nSamples; ++i) {
+            m_dryRows[i * stride + k] = input[i];
+            m_wetRows[i * stride + k] = accum[i];
+        }
+    }
+    
+    // 3. Feedback path of all lanes, one sample at a time across the lanes
+    Utils::FeedbackLanes lanes{0.0f, feedback, mix, damping, m_dcBlocker.m_coeff, m_dampState, m_dcState};
+    
+    // Playing grains fade out with the wet gain during a reset
+    float wetGain = m_resetFade;
+    const float wetGainStep = m_resetFading ? m_resetFadeStep : 0.0f;
+    
+    if (!anyDeferred) {
+        for (int i = 0; i < nSamples; ++i) {
+            lanes.compensation = (gainStart + gainStep * i) * wetGain;
+            wetGain = std::max(0.0f, wetGain + wetGainStep);
+            Utils::processFeedbackLanes(lanes, m_dryRows + i * stride, m_wetRows + i * stride, m_outRows + i * stride, m_writeRows + i * stride, stride);
+        }
+        
+        // 4. Write the lines (only when not frozen)
+        if (!freeze) {
+            writeLines<MaxGrains>(0, nSamples);
+        }
+    } else {
+        // 3 and 4 a sample at a time, deferred grains read each sample after the write
+        // before it, as GrainDelay does. Deferral only happens while the lines are written.
+        for (int i = 0; i < nSamples; ++i) {
+            for (int k = 0; k < numLanes; ++k) {
+                Lane<MaxGrains>& state = lane<MaxGrains>(k);
+                
+                if (state.numDeferred > 0) {
+                    renderDeferred<MaxGrains>(state, line(k), m_wetRows + i * stride + k, i);
+                }
+            }
+            
+            lanes.compensation = (gainStart + gainStep * i) * wetGain;
+            wetGain = std::max(0.0f, wetGain + wetGainStep);
+            Utils::processFeedbackLanes(lanes, m_dryRows + i * stride, m_wetRows + i * stride, m_outRows + i * stride, m_writeRows + i * stride, stride);
+            writeLines<MaxGrains>(i, 1);
+        }
+        
+        // Grains still playing render as usual from the next block on
+        for (int k = 0; k < numLanes; ++k) {
+            Lane<MaxGrains>& state = lane<MaxGrains>(k);
+            
+            for (int d = 0; d < state.numDeferred; ++d) {
+                state.deferred[state.deferredChannels[d]] = false;
+            }
+            state.numDeferred = 0;
+        }
+    }
+    
+    if (!freeze) {
+        m_writePos = (m_writePos + nSamples) & (m_bufSize - 1);
+    }
+    
+    // A faded reset stops the grains, then every clear moves on by the samples written
+    // and another slice
+    bool resetDone = false;
+    
+    if (m_resetFading) {
+        m_resetFade = wetGain;
+        
+        if (wetGain <= 0.0f) {
+            resetLanes<MaxGrains>();
+            resetDone = true;
+        }
+    }
+    for (int k = 0; k < numLanes; ++k) {
+        Lane<MaxGrains>& state = lane<MaxGrains>(k);
+        
+        if (state.clearing) {
+            advanceClear<MaxGrains>(state, k, resetDone ? 0 : writeLength);
+        }
+    }
+    
+    // 5. Outputs
+    for (int k = 0; k < numLanes; ++k) {
+        float* output = out(k);
+        
+        for (int i = 0; i < nSamples; ++i) {
+            output[i] = m_outRows[i * stride + k];
+        }
+    }
+    
+    // Once per block: decaying states would otherwise settle on denormals
+    for (int k = 0; k < numLanes; ++k) {
+        m_dampState[k] = zapgremlins(m_dampState[k]);
+        m_dcState[k] = zapgremlins(m_dcState[k]);
+    }
+}
+
+void registerGrainDelayBank(InterfaceTable* inTable, const Utils::WindowTables& windowTables) {
+    ft = inTable;
+    s_windowTables = &windowTables;
+    registerUnit<GrainDelayBank>(ft, "GrainDelayBank", false);
+}
@@ -0,0 +1,188 @@
+#pragma once
+#include "SC_PlugIn.hpp"
+#include "Utils.hpp"
+#include <array>
+
+// ===== GRAIN DELAY BANK =====
+
+// Many independent grain delays in one UGen, one lane per input channel. Every lane has
+// its own input, output, delay line, trigger ramp and grains; triggerRate, delayTime and
+// grainRate are set per lane, the other parameters apply to all lanes. Grains of each
+// lane are rendered for the whole block, then the feedback write path runs across lanes
+// with the filter states interleaved, so one calc function replaces a node per lane.
+class GrainDelayBank : public SCUnit {
+public:
+    GrainDelayBank();
+    ~GrainDelayBank();
+
+private:
+    template <int MaxGrains>
+    void next(int nSamples);
+    void next_silent(int nSamples);
+    
+    // Allocates the lane pool and picks the calc function for a voice count
+    template <int MaxGrains>
+    bool initLanes();
+    
+    // Grain state of one lane, in the same layout as the voice pool of GrainDelay
+    // without voice stealing or panning
+    template <int MaxGrains>
+    struct Lane {
+        using Events = Utils::EventSystem<MaxGrains>;
+        
+        Events eventSystem;
+        alignas(64) std::array<float, MaxGrains> readOffset{};  // Delay line position at onset, samples
+        alignas(64) std::array<float, MaxGrains> rate{};        // Playback rate
+        alignas(64) std::array<float, MaxGrains> phase{};       // Samples read since onset
+        std::array<const Utils::WindowTable*, MaxGrains> window{};
+        
+        // Control-rate values of the lane inputs at the end of the previous block
+        float lastTriggerRate = 0.0f;
+        float lastDelayTime = 0.0f;
+        float lastGrainRate = 1.0f;
+        
+        // Grains whose reads reach the samples this block writes, finished one sample at
+        // a time after the writes from their first such sample on, see next()
+        std::array<bool, MaxGrains> deferred{};
+        std::array<int, MaxGrains> deferredFrom{};      // Block sample, per channel
+        std::array<int, MaxGrains> deferredChannels{};
+        int numDeferred = 0;
+        
+        // Consecutive silent samples written to the line, see GrainDelay::isIdle
+        int silentSamples = 0;
+        bool idle = false;
+        
+        // Clear of the line after a reset, see GrainDelay::advanceClear
+        bool clearing = false;
+        int cleanLength = 0;
+    };
+    
+    template <int MaxGrains>
+    Lane<MaxGrains>& lane(int index) const {
+        return static_cast<Lane<MaxGrains>*>(m_lanes)[index];
+    }
+    
+    Utils::RingBuffer line(int index) const {
+        return Utils::RingBuffer{m_lineMemory + static_cast<size_t>(index) * Utils::RingBuffer::allocationSize(m_bufSize), m_bufSize, m_bufSize - 1};
+    }
+    
+    // Lane inputs follow the shared inputs, NumLaneInputs per lane
+    int laneInput(int index, int param) const {
+        return NumSharedInputs + index * NumLaneInputs + param;
+    }
+    
+    // Control input ramped across the block, updates the stored control value
+    Utils::ParamSignal paramSignal(int index, float& lastValue, float lo, float hi);
+    
+    // Block rendering helpers
+    template <int MaxGrains>
+    void startGrain(Lane<MaxGrains>& lane, int writeHead, float overlap, float delayTime, float grainRate, const Utils::WindowTable& window, float delayJitter, float rateJitter);
+    template <int MaxGrains>
+    void renderGrains(Lane<MaxGrains>& lane, const Utils::RingBuffer& line, float* accum, int segmentStart, int numSamples, int writeLength);
+    template <int MaxGrains>
+    void renderDeferred(Lane<MaxGrains>& lane, const Utils::RingBuffer& line, float* accum, int sample);
+    int safeGrainLength(float readOffset, float phase, float rate, int writeLength, int maxLength) const;
+    template <int MaxGrains>
+    void writeLines(int offset, int numSamples);
+    void muteStaleReads(const float* phases, float* gains, int numSamples, int writeHead, int cleanLength) const;
+    template <int MaxGrains>
+    void advanceClear(Lane<MaxGrains>& lane, int index, int numWritten);
+    template <int MaxGrains>
+    void resetLanes();
+    template <int MaxGrains>
+    void skipGrains(Lane<MaxGrains>& lane, int numSamples);
+    template <int MaxGrains>
+    bool isLaneIdle(int index, const float* input, int numSamples) const;
+    
+    // Constants cached at construction
+    const float m_sampleRate;
+    const float m_sampleDur;
+    const int m_numLanes;
+    const int m_numPaddedLanes;   // m_numLanes rounded up to whole SIMD registers
+    const float m_minDelayTime;   // Grains never read the block being written, see next()
+    const float m_maxDelayTime;
+    const int m_bufSize;
+    const float m_bufFrames;
+    const int m_maxGrains;
+    const float m_resetFadeStep;
+    
+    // Constants
+    static constexpr int MIN_GRAINS = 4;
+    static constexpr int MAX_GRAINS = 32;
+    static constexpr float MAX_DELAY_TIME = 60.0f;
+    static constexpr size_t MAX_LINE_FRAMES = size_t(1) << 29; // Per lane, keeps the int index math in range
+    static constexpr int LANE_ALIGNMENT = 8;   // Lanes per AVX register
+    static constexpr float DC_BLOCK_CUTOFF = 3.0f;
+    static constexpr float MIN_OVERLAP = 0.001f;
+    static constexpr float MIN_GRAIN_RATE = 0.125f;
+    static constexpr float MAX_GRAIN_RATE = 4.0f;
+    static constexpr float MAX_RATE_JITTER = 2.0f;  // Octaves
+    static constexpr float RESET_FADE_TIME = 0.005f;
+    static constexpr int CLEAR_SLICE_SIZE = 4096;   // Samples of each line zeroed per block after a reset
+    static constexpr size_t MEMORY_ALIGNMENT = 64;
+    
+    // Control-rate value of the shared overlap at the end of the previous block
+    float m_lastOverlap;
+    
+    // Write head, shared since all lines have the same length and freeze together
+    int m_writePos = 0;
+    
+    // Reset state, shared by all lanes as in GrainDelay: the wet signals fade out, then all
+    // grains stop and each lane that was not silent clears its line a slice per block
+    float m_resetFade = 1.0f;
+    bool m_resetFading = false;
+    bool m_lastReset = false;
+    
+    // Interpolation of the grain reads for the current block
+    Utils::InterpMode m_interpMode = Utils::InterpMode::Cubic;
+    
+    // Delay lines, one after the other (allocated from the RT pool)
+    float* m_lineMemory = nullptr;
+    
+    // Lane pool (allocated from the RT pool, m_lanes aligned for the slot arrays)
+    void* m_laneMemory = nullptr;
+    void* m_lanes = nullptr;
+    
+    // Feedback path state and block buffers (allocated from the RT pool in one piece).
+    // The row buffers are lane-interleaved, sample i of lane k at i * m_numPaddedLanes + k,
+    // the grain accumulators are one block per lane.
+    void* m_workMemory = nullptr;
+    float* m_dampState = nullptr;
+    float* m_dcState = nullptr;
+    float* m_dryRows = nullptr;
+    float* m_wetRows = nullptr;
+    float* m_outRows = nullptr;
+    float* m_writeRows = nullptr;
+    float* m_grainBlocks = nullptr;
+    
+    // DC blocker coefficient, the filter states are per lane
+    Utils::OnePoleFilter m_dcBlocker;
+    
+    // Shared inputs, then per lane: input, triggerRate, delayTime, grainRate
+    enum SharedInputs {
+        Overlap,        // Grain overlap amount (control rate)
+        Mix,            // Wet/dry mix (0=dry, 1=wet)
+        Feedback,       // Feedback amount (0-0.99)
+        Damping,        // Feedback filter (0=bright, 1=dark)
+        Freeze,         // Freeze all lines (0=record, 1=freeze)
+        Reset,          // Reset trigger
+        MaxDelayTime,   // Maximum delay time in seconds (init-rate)
+        WindowType,     // Grain window (0=Hann, 1=Tukey, 2=Welch, 3=exponential decay)
+        GrainsPerLane,  // Maximum number of simultaneous grains per lane (init-rate, rounded up to 4, 8, 16 or 32)
+        Interpolation,  // Grain read interpolation (0 = none, 1 = linear, 2 = cubic, 3 = 6-point Hermite)
+        DelayJitter,    // Random per-grain delay scatter, fraction of delayTime (0-1)
+        RateJitter,     // Random per-grain rate scatter in octaves (0-2)
+        NumSharedInputs
+    };
+    
+    enum LaneInputs {
+        LaneInput,        // Audio input of the lane
+        LaneTriggerRate,  // Grain trigger rate (Hz, control rate)
+        LaneDelayTime,    // Delay time in seconds (control rate)
+        LaneGrainRate,    // Grain playback rate (control rate)
+        NumLaneInputs
+    };
+};
+
+// Registers the unit, called from the plugin's load function with its window tables
+void registerGrainDelayBank(InterfaceTable* inTable, const Utils::WindowTables& windowTables);
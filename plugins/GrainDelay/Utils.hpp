@@ -1,9 +1,34 @@
 #pragma once
 #include "SC_PlugIn.hpp"
 #include <array>
-#include <vector>        
 #include <cmath>       
 #include <algorithm> 
+#include <cstring>
+
+// Compile-time SIMD dispatch: AVX (8 lanes), SSE2 or NEON (4 lanes), scalar otherwise
+#if defined(__AVX__)
+    #define GRAINDELAY_SIMD_AVX
+    #define GRAINDELAY_SIMD_SSE
+    #include <immintrin.h>
+#elif defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #define GRAINDELAY_SIMD_SSE
+    #include <emmintrin.h>
+#elif defined(__ARM_NEON) || defined(__ARM_NEON__)
+    #define GRAINDELAY_SIMD_NEON
+    #include <arm_neon.h>
+#endif
+
+// Cycle counter of the optional calc function profiler, see PROFILING
+#if defined(GRAINDELAY_PROFILE)
+    #if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+        #include <intrin.h>
+    #elif defined(__x86_64__) || defined(__i386__)
+        #include <x86intrin.h>
+    #elif !defined(__aarch64__)
+        #include <chrono>
+    #endif
+    #include <limits>
+#endif
 
 namespace Utils {
 
@@ -13,16 +38,163 @@ inline float lerp(float a, float b, float t) {
     return a + t * (b - a);
 }
 
+// Smallest power of two >= n
+inline int nextPowerOfTwo(int n) {
+    int size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
+inline size_t nextPowerOfTwo(size_t n) {
+    size_t size = 1;
+    while (size < n) {
+        size <<= 1;
+    }
+    return size;
+}
+
 // Math constants
 inline constexpr float TWO_PI = 6.28318530717958647692f;
 
 // Granular utility functions
-float hanningWindow(float phase) {
+inline float hanningWindow(float phase) {
     return (1.0f - std::cos(phase * TWO_PI)) * 0.5f;
 }
 
+// Amplitude compensation for overlapping grains
+inline float overlapCompensation(float overlap) {
+    return 1.0f / std::sqrt(std::max(1.0f, overlap));
+}
+
+// Equal-power position between two neighbouring outputs of a line of numOutputs
+struct PanPosition {
+    int channel{0};         // Lower output channel
+    float gainLow{1.0f};
+    float gainHigh{0.0f};
+};
+
+inline PanPosition panPosition(float position, int numOutputs) {
+    if (numOutputs < 2) {
+        return PanPosition{};
+    }
+    
+    // Map -1..1 onto output channels 0..numOutputs-1
+    const float scaled = (sc_clip(position, -1.0f, 1.0f) * 0.5f + 0.5f) * (numOutputs - 1);
+    const int channel = std::min(static_cast<int>(scaled), numOutputs - 2);
+    const float angle = (scaled - channel) * TWO_PI * 0.25f;
+    return PanPosition{channel, std::cos(angle), std::sin(angle)};
+}
+
+// ===== PARAMETER UTILITIES =====
+
+// Rate combination of the modulatable inputs a calc function is specialized for
+enum class ParamRates {
+    Audio,      // All audio rate
+    Control,    // All control or scalar rate
+    Mixed
+};
+
+// Per-block view of a modulatable input: either its audio buffer, or a linear ramp
+// from the previous control value to the current one. Ramp endpoints are clipped
+// when the ramp is set up, so the control path never clips per sample.
+struct ParamSignal {
+    const float* buffer{nullptr};   // nullptr for a control ramp
+    float start{0.0f};
+    float step{0.0f};
+    float lo{0.0f};
+    float hi{0.0f};
+    
+    template <ParamRates Rates>
+    float at(int i) const {
+        if constexpr (Rates == ParamRates::Audio) {
+            return sc_clip(buffer[i], lo, hi);
+        } else if constexpr (Rates == ParamRates::Control) {
+            return start + step * i;
+        } else {
+            return buffer ? sc_clip(buffer[i], lo, hi) : start + step * i;
+        }
+    }
+};
+
+// ===== WINDOW TABLES =====
+
+enum class WindowShape {
+    Hann,       // Raised cosine
+    Tukey,      // Flat top with raised cosine tapers over 25% at each end
+    Welch,      // Parabola
+    ExpDecay,   // 10% raised cosine attack, then exponential decay to -60 dB
+    NumShapes
+};
+
+inline double windowShapeValue(WindowShape shape, double x) {
+    constexpr double pi = 3.14159265358979323846;
+    switch (shape) {
+        case WindowShape::Tukey: {
+            constexpr double taper = 0.25;
+            const double edge = std::min(x, 1.0 - x);
+            return edge < taper ? 0.5 * (1.0 - std::cos(pi * edge / taper)) : 1.0;
+        }
+        case WindowShape::Welch: {
+            const double centered = 2.0 * x - 1.0;
+            return 1.0 - centered * centered;
+        }
+        case WindowShape::ExpDecay: {
+            constexpr double attack = 0.1;
+            if (x < attack) {
+                return 0.5 * (1.0 - std::cos(pi * x / attack));
+            }
+            return std::exp(-6.907755278982137 * (x - attack) / (1.0 - attack));
+        }
+        case WindowShape::Hann:
+        default:
+            return 0.5 * (1.0 - std::cos(2.0 * pi * x));
+    }
+}
+
+// Linearly interpolated window over phase [0,1), filled once at plugin load and only read
+// afterwards. With h = 1/SIZE the interpolation error is at most h^2/8 * max|w''|:
+// Hann 5.9e-7, Welch 2.4e-7, Tukey 2.4e-6, ExpDecay 1.5e-5 (attack) / 1.8e-6 (decay).
+struct WindowTable {
+    static constexpr int SIZE = 2048;
+    
+    // One extra point for phase 1 and a guard point for rounding at the upper end
+    std::array<float, SIZE + 2> values{};
+    
+    void fill(WindowShape shape) {
+        for (int i = 0; i <= SIZE; ++i) {
+            values[i] = static_cast<float>(windowShapeValue(shape, static_cast<double>(i) / SIZE));
+        }
+        values[SIZE + 1] = values[SIZE];
+    }
+    
+    float lookup(float phase) const {
+        const float position = phase * SIZE;
+        const int index = static_cast<int>(position);
+        return lerp(values[index], values[index + 1], position - index);
+    }
+};
+
+struct WindowTables {
+    std::array<WindowTable, static_cast<int>(WindowShape::NumShapes)> tables;
+    
+    void fill() {
+        for (int i = 0; i < static_cast<int>(WindowShape::NumShapes); ++i) {
+            tables[i].fill(static_cast<WindowShape>(i));
+        }
+    }
+    
+    // Out-of-range selections fall back to Hann
+    const WindowTable& get(int shape) const {
+        const bool valid = shape >= 0 && shape < static_cast<int>(WindowShape::NumShapes);
+        return tables[valid ? shape : static_cast<int>(WindowShape::Hann)];
+    }
+};
+
 // ===== BUFFER ACCESS UTILITIES =====
 
+// Wrapping 4-point read for buffers of arbitrary size
 inline float peekCubicInterp(const float* buffer, int bufSize, float phase) {
 
     const float sampleIndex = phase;
@@ -42,16 +214,523 @@ inline float peekCubicInterp(const float* buffer, int bufSize, float phase) {
     return cubicinterp(fracPart, a, b, c, d);
 }
 
+// Interpolation of delay line reads, in order of quality and cost
+enum class InterpMode {
+    None,       // Truncate to the previous sample
+    Linear,     // 2-point linear
+    Cubic,      // 4-point cubic (SuperCollider's cubicinterp)
+    Hermite6,   // 6-point 5th-order Hermite
+    NumModes
+};
+
+// 6-point 5th-order Hermite through y[-2]..y[3] (Niemitalo, x-form), x in [0,1)
+inline float hermite6Interp(float x, float ym2, float ym1, float y0, float y1, float y2, float y3) {
+    const float eighthYm2 = (1.0f / 8.0f) * ym2;
+    const float elevenTwentyFourthY2 = (11.0f / 24.0f) * y2;
+    const float twelfthY3 = (1.0f / 12.0f) * y3;
+    const float c0 = y0;
+    const float c1 = (1.0f / 12.0f) * (ym2 - y2) + (2.0f / 3.0f) * (y1 - ym1);
+    const float c2 = (13.0f / 12.0f) * ym1 - (25.0f / 12.0f) * y0 + 1.5f * y1 - elevenTwentyFourthY2 + twelfthY3 - eighthYm2;
+    const float c3 = (5.0f / 12.0f) * y0 - (7.0f / 12.0f) * y1 + (7.0f / 24.0f) * y2 - (1.0f / 24.0f) * (ym2 + ym1 + y3);
+    const float c4 = eighthYm2 - (7.0f / 12.0f) * ym1 + (13.0f / 12.0f) * y0 - y1 + elevenTwentyFourthY2 - twelfthY3;
+    const float c5 = (1.0f / 24.0f) * (y3 - ym2) + (5.0f / 24.0f) * (ym1 - y2) + (5.0f / 12.0f) * (y1 - y0);
+    return ((((c5 * x + c4) * x + c3) * x + c2) * x + c1) * x + c0;
+}
+
+// Wrapping reads for buffers of arbitrary size
+template <InterpMode Mode>
+inline float peekInterp(const float* buffer, int bufSize, float phase) {
+    const int intPart = static_cast<int>(phase);
+    const float fracPart = phase - intPart;
+    
+    if constexpr (Mode == InterpMode::None) {
+        return buffer[sc_wrap(intPart, 0, bufSize - 1)];
+    } else if constexpr (Mode == InterpMode::Linear) {
+        return lerp(buffer[sc_wrap(intPart, 0, bufSize - 1)], buffer[sc_wrap(intPart + 1, 0, bufSize - 1)], fracPart);
+    } else if constexpr (Mode == InterpMode::Cubic) {
+        return peekCubicInterp(buffer, bufSize, phase);
+    } else {
+        return hermite6Interp(fracPart,
+            buffer[sc_wrap(intPart - 2, 0, bufSize - 1)], buffer[sc_wrap(intPart - 1, 0, bufSize - 1)],
+            buffer[sc_wrap(intPart, 0, bufSize - 1)], buffer[sc_wrap(intPart + 1, 0, bufSize - 1)],
+            buffer[sc_wrap(intPart + 2, 0, bufSize - 1)], buffer[sc_wrap(intPart + 3, 0, bufSize - 1)]);
+    }
+}
+
+// ===== RING BUFFER =====
+
+// Power-of-two ring buffer over caller-owned memory. The first GUARD samples
+// are mirrored past the end, so a read of up to 6 points never has to wrap per tap.
+struct RingBuffer {
+    static constexpr int GUARD = 5;
+    
+    float* data{nullptr};
+    int size{0};
+    int mask{0};
+    
+    // Number of floats the caller has to provide for a buffer of 'size' samples
+    static constexpr int allocationSize(int size) {
+        return size + GUARD;
+    }
+    
+    void init(float* memory, int powerOfTwoSize) {
+        data = memory;
+        size = powerOfTwoSize;
+        mask = powerOfTwoSize - 1;
+        std::fill(data, data + allocationSize(size), 0.0f);
+    }
+    
+    int wrap(int index) const {
+        return index & mask;
+    }
+    
+    float load(int index) const {
+        return data[index];
+    }
+    
+    void write(int index, float value) {
+        data[index] = value;
+        if (index < GUARD) {
+            data[size + index] = value;
+        }
+    }
+    
+    // Mirrors the first samples into the guard region after writing 'data' directly
+    void updateGuard() {
+        std::copy(data, data + GUARD, data + size);
+    }
+};
+
+// Sample formats of the internal delay line
+enum class LineFormat {
+    Float,      // 32-bit float
+    Int16,      // 16-bit integer with TPDF dither, full scale at +-1
+    Half,       // IEEE 754 half float
+    NumFormats
+};
+
+inline float bitsToFloat(uint32 bits) {
+    float value;
+    std::memcpy(&value, &bits, sizeof(value));
+    return value;
+}
+
+inline uint32 floatToBits(float value) {
+    uint32 bits;
+    std::memcpy(&bits, &value, sizeof(bits));
+    return bits;
+}
+
+constexpr float INT16_SCALE = 32767.0f;
+
+inline float decodeInt16(uint16 bits) {
+    return static_cast<float>(static_cast<int16>(bits)) * (1.0f / INT16_SCALE);
+}
+
+// Exact for every half value, rebuilt with integer ops so subnormal halves never
+// pass through float denormals, which the server may flush to zero
+inline float decodeHalf(uint16 bits) {
+    uint32 magnitude = static_cast<uint32>(bits & 0x7fffu) << 13;
+    const bool subnormal = (magnitude & (0x7c00u << 13)) == 0;
+    magnitude += (127 - 15) << 23;
+    
+    if (subnormal) {
+        magnitude = floatToBits(bitsToFloat(magnitude + (1u << 23)) - bitsToFloat(113u << 23));
+    }
+    return bitsToFloat(magnitude | (static_cast<uint32>(bits & 0x8000u) << 16));
+}
+
+// Round to nearest even. Values beyond the half range are clipped, values below
+// HALF_SILENCE are stored as 0: there the subnormal steps are coarse enough for
+// rounding to hold a decaying feedback tail at a constant level forever.
+constexpr float HALF_MAX = 65504.0f;
+constexpr float HALF_SILENCE = 1.0f / 262144.0f;  // 2^-18, about -108 dB
+
+inline uint16 encodeHalf(float value) {
+    if (std::abs(value) < HALF_SILENCE) {
+        return 0;
+    }
+    
+    uint32 magnitude = floatToBits(sc_clip(value, -HALF_MAX, HALF_MAX));
+    const uint32 sign = magnitude & 0x80000000u;
+    magnitude ^= sign;
+    uint32 bits;
+    
+    if (magnitude < (113u << 23)) {
+        // Subnormal half: the float add rounds the mantissa into place
+        const float magic = bitsToFloat(((127 - 15) + (23 - 10) + 1) << 23);
+        bits = floatToBits(bitsToFloat(magnitude) + magic) - floatToBits(magic);
+    } else {
+        const uint32 odd = (magnitude >> 13) & 1u;
+        magnitude += (static_cast<uint32>(15 - 127) << 23) + 0xfffu + odd;
+        bits = magnitude >> 13;
+    }
+    return static_cast<uint16>(bits | (sign >> 16));
+}
+
+// Ring buffer of 16-bit samples, the same layout as RingBuffer at half the memory and
+// cache footprint. Reads convert to float, writes round (and dither) once.
+template <LineFormat Format>
+struct CompactRingBuffer {
+    static_assert(Format != LineFormat::Float, "float lines use RingBuffer");
+    static constexpr int GUARD = RingBuffer::GUARD;
+    
+    uint16* data{nullptr};
+    int size{0};
+    int mask{0};
+    uint32 ditherState{0x9e3779b9u};
+    
+    static constexpr int allocationSize(int size) {
+        return size + GUARD;
+    }
+    
+    void init(uint16* memory, int powerOfTwoSize) {
+        data = memory;
+        size = powerOfTwoSize;
+        mask = powerOfTwoSize - 1;
+        std::fill(data, data + allocationSize(size), static_cast<uint16>(0));
+    }
+    
+    int wrap(int index) const {
+        return index & mask;
+    }
+    
+    float load(int index) const {
+        if constexpr (Format == LineFormat::Int16) {
+            return decodeInt16(data[index]);
+        } else {
+            return decodeHalf(data[index]);
+        }
+    }
+    
+    // Uniform in [-0.5, 0.5) steps
+    float dither() {
+        ditherState = ditherState * 1664525u + 1013904223u;
+        return static_cast<float>(ditherState >> 8) * (1.0f / 16777216.0f) - 0.5f;
+    }
+    
+    uint16 encode(float value) {
+        if constexpr (Format == LineFormat::Int16) {
+            // Triangular dither above two steps. Below, rounding toward zero lets a
+            // decaying feedback tail reach silence instead of hovering at one step.
+            const float scaled = value * INT16_SCALE;
+            float rounded;
+            
+            if (std::abs(scaled) < 2.0f) {
+                rounded = std::trunc(scaled);
+            } else {
+                rounded = sc_clip(std::floor(scaled + dither() + dither() + 0.5f), -INT16_SCALE, INT16_SCALE);
+            }
+            return static_cast<uint16>(static_cast<int16>(rounded));
+        } else {
+            return encodeHalf(value);
+        }
+    }
+    
+    void write(int index, float value) {
+        const uint16 bits = encode(value);
+        data[index] = bits;
+        if (index < GUARD) {
+            data[size + index] = bits;
+        }
+    }
+    
+    void updateGuard() {
+        std::copy(data, data + GUARD, data + size);
+    }
+};
+
+// Reads of a RingBuffer or CompactRingBuffer
+template <class Line>
+inline float peekCubicInterp(const Line& buffer, float phase) {
+
+    const int intPart = static_cast<int>(phase);
+    const float fracPart = phase - intPart;
+    
+    // Taps idx0..idx0+3 stay inside the guard region
+    const int idx0 = buffer.wrap(intPart - 1);
+    
+    return cubicinterp(fracPart, buffer.load(idx0), buffer.load(idx0 + 1), buffer.load(idx0 + 2), buffer.load(idx0 + 3));
+}
+
+template <InterpMode Mode, class Line>
+inline float peekInterp(const Line& buffer, float phase) {
+    const int intPart = static_cast<int>(phase);
+    const float fracPart = phase - intPart;
+    
+    if constexpr (Mode == InterpMode::None) {
+        return buffer.load(buffer.wrap(intPart));
+    } else if constexpr (Mode == InterpMode::Linear) {
+        const int idx0 = buffer.wrap(intPart);
+        return lerp(buffer.load(idx0), buffer.load(idx0 + 1), fracPart);
+    } else if constexpr (Mode == InterpMode::Cubic) {
+        return peekCubicInterp(buffer, phase);
+    } else {
+        const int idx0 = buffer.wrap(intPart - 2);
+        return hermite6Interp(fracPart, buffer.load(idx0), buffer.load(idx0 + 1), buffer.load(idx0 + 2),
+                              buffer.load(idx0 + 3), buffer.load(idx0 + 4), buffer.load(idx0 + 5));
+    }
+}
+
+// ===== SIMD KERNELS =====
+
+// The vector paths evaluate cubicinterp() with the same operation order as the
+// scalar version. The guard region of RingBuffer makes the four taps of every
+// sample one unaligned load, which is then transposed into tap vectors. 16-bit
+// lines load the four taps as one 64-bit load and widen them to float, with the
+// same results as the scalar conversions.
+
+#if defined(GRAINDELAY_SIMD_SSE)
+
+inline __m128 loadTaps4(const RingBuffer& buffer, int index) {
+    return _mm_loadu_ps(buffer.data + index);
+}
+
+template <LineFormat Format>
+inline __m128 loadTaps4(const CompactRingBuffer<Format>& buffer, int index) {
+    const __m128i raw = _mm_loadl_epi64(reinterpret_cast<const __m128i*>(buffer.data + index));
+    
+    if constexpr (Format == LineFormat::Int16) {
+        const __m128i wide = _mm_srai_epi32(_mm_unpacklo_epi16(raw, raw), 16);
+        return _mm_mul_ps(_mm_cvtepi32_ps(wide), _mm_set1_ps(1.0f / INT16_SCALE));
+    } else {
+#if defined(__F16C__)
+        return _mm_cvtph_ps(raw);
+#else
+        // decodeHalf() on four lanes, subnormals selected by a mask
+        const __m128i wide = _mm_unpacklo_epi16(raw, _mm_setzero_si128());
+        const __m128i sign = _mm_slli_epi32(_mm_and_si128(wide, _mm_set1_epi32(0x8000)), 16);
+        __m128i magnitude = _mm_slli_epi32(_mm_and_si128(wide, _mm_set1_epi32(0x7fff)), 13);
+        const __m128 subnormal = _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(magnitude, _mm_set1_epi32(0x7c00 << 13)), _mm_setzero_si128()));
+        magnitude = _mm_add_epi32(magnitude, _mm_set1_epi32((127 - 15) << 23));
+        
+        const __m128 normal = _mm_castsi128_ps(magnitude);
+        const __m128 renormalized = _mm_sub_ps(_mm_castsi128_ps(_mm_add_epi32(magnitude, _mm_set1_epi32(1 << 23))), _mm_castsi128_ps(_mm_set1_epi32(113 << 23)));
+        const __m128 value = _mm_or_ps(_mm_and_ps(subnormal, renormalized), _mm_andnot_ps(subnormal, normal));
+        return _mm_or_ps(value, _mm_castsi128_ps(sign));
+#endif
+    }
+}
+
+inline __m128 cubicInterp4(__m128 x, __m128 y0, __m128 y1, __m128 y2, __m128 y3) {
+    const __m128 c0 = y1;
+    const __m128 c1 = _mm_mul_ps(_mm_set1_ps(0.5f), _mm_sub_ps(y2, y0));
+    const __m128 c2 = _mm_sub_ps(
+        _mm_add_ps(_mm_sub_ps(y0, _mm_mul_ps(_mm_set1_ps(2.5f), y1)), _mm_mul_ps(_mm_set1_ps(2.0f), y2)),
+        _mm_mul_ps(_mm_set1_ps(0.5f), y3));
+    const __m128 c3 = _mm_add_ps(
+        _mm_mul_ps(_mm_set1_ps(0.5f), _mm_sub_ps(y3, y0)),
+        _mm_mul_ps(_mm_set1_ps(1.5f), _mm_sub_ps(y1, y2)));
+    return _mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(_mm_add_ps(_mm_mul_ps(c3, x), c2), x), c1), x), c0);
+}
+
+template <class Line>
+inline __m128 peekCubicInterp4(const Line& buffer, __m128 phase) {
+    const __m128i intPart = _mm_cvttps_epi32(phase);
+    const __m128 fracPart = _mm_sub_ps(phase, _mm_cvtepi32_ps(intPart));
+    
+    alignas(16) int index[4];
+    _mm_store_si128(reinterpret_cast<__m128i*>(index),
+        _mm_and_si128(_mm_sub_epi32(intPart, _mm_set1_epi32(1)), _mm_set1_epi32(buffer.mask)));
+    
+    __m128 y0 = loadTaps4(buffer, index[0]);
+    __m128 y1 = loadTaps4(buffer, index[1]);
+    __m128 y2 = loadTaps4(buffer, index[2]);
+    __m128 y3 = loadTaps4(buffer, index[3]);
+    _MM_TRANSPOSE4_PS(y0, y1, y2, y3);
+    
+    return cubicInterp4(fracPart, y0, y1, y2, y3);
+}
+
+#endif
+
+#if defined(GRAINDELAY_SIMD_AVX)
+
+inline __m256 cubicInterp8(__m256 x, __m256 y0, __m256 y1, __m256 y2, __m256 y3) {
+    const __m256 c0 = y1;
+    const __m256 c1 = _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_sub_ps(y2, y0));
+    const __m256 c2 = _mm256_sub_ps(
+        _mm256_add_ps(_mm256_sub_ps(y0, _mm256_mul_ps(_mm256_set1_ps(2.5f), y1)), _mm256_mul_ps(_mm256_set1_ps(2.0f), y2)),
+        _mm256_mul_ps(_mm256_set1_ps(0.5f), y3));
+    const __m256 c3 = _mm256_add_ps(
+        _mm256_mul_ps(_mm256_set1_ps(0.5f), _mm256_sub_ps(y3, y0)),
+        _mm256_mul_ps(_mm256_set1_ps(1.5f), _mm256_sub_ps(y1, y2)));
+    return _mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(_mm256_add_ps(_mm256_mul_ps(c3, x), c2), x), c1), x), c0);
+}
+
+template <class Line>
+inline __m256 peekCubicInterp8(const Line& buffer, __m256 phase) {
+    const __m256i intPart = _mm256_cvttps_epi32(phase);
+    const __m256 fracPart = _mm256_sub_ps(phase, _mm256_cvtepi32_ps(intPart));
+    
+    // AVX has no 256-bit integer ops, so wrap the indices in two SSE halves
+    const __m128i one = _mm_set1_epi32(1);
+    const __m128i mask = _mm_set1_epi32(buffer.mask);
+    alignas(16) int index[8];
+    _mm_store_si128(reinterpret_cast<__m128i*>(index),
+        _mm_and_si128(_mm_sub_epi32(_mm256_castsi256_si128(intPart), one), mask));
+    _mm_store_si128(reinterpret_cast<__m128i*>(index + 4),
+        _mm_and_si128(_mm_sub_epi32(_mm256_extractf128_si256(intPart, 1), one), mask));
+    
+    // Taps of samples k and k + 4 share a row, then transpose within each 128-bit lane
+    const __m256 r0 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadTaps4(buffer, index[0])), loadTaps4(buffer, index[4]), 1);
+    const __m256 r1 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadTaps4(buffer, index[1])), loadTaps4(buffer, index[5]), 1);
+    const __m256 r2 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadTaps4(buffer, index[2])), loadTaps4(buffer, index[6]), 1);
+    const __m256 r3 = _mm256_insertf128_ps(_mm256_castps128_ps256(loadTaps4(buffer, index[3])), loadTaps4(buffer, index[7]), 1);
+    
+    const __m256 t0 = _mm256_unpacklo_ps(r0, r1);
+    const __m256 t1 = _mm256_unpackhi_ps(r0, r1);
+    const __m256 t2 = _mm256_unpacklo_ps(r2, r3);
+    const __m256 t3 = _mm256_unpackhi_ps(r2, r3);
+    
+    const __m256 y0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 y1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+    const __m256 y2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+    const __m256 y3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+    
+    return cubicInterp8(fracPart, y0, y1, y2, y3);
+}
+
+#endif
+
+#if defined(GRAINDELAY_SIMD_NEON)
+
+inline float32x4_t cubicInterp4(float32x4_t x, float32x4_t y0, float32x4_t y1, float32x4_t y2, float32x4_t y3) {
+    const float32x4_t c0 = y1;
+    const float32x4_t c1 = vmulq_n_f32(vsubq_f32(y2, y0), 0.5f);
+    const float32x4_t c2 = vsubq_f32(
+        vaddq_f32(vsubq_f32(y0, vmulq_n_f32(y1, 2.5f)), vmulq_n_f32(y2, 2.0f)),
+        vmulq_n_f32(y3, 0.5f));
+    const float32x4_t c3 = vaddq_f32(
+        vmulq_n_f32(vsubq_f32(y3, y0), 0.5f),
+        vmulq_n_f32(vsubq_f32(y1, y2), 1.5f));
+    return vaddq_f32(vmulq_f32(vaddq_f32(vmulq_f32(vaddq_f32(vmulq_f32(c3, x), c2), x), c1), x), c0);
+}
+
+inline float32x4_t loadTaps4(const RingBuffer& buffer, int index) {
+    return vld1q_f32(buffer.data + index);
+}
+
+template <LineFormat Format>
+inline float32x4_t loadTaps4(const CompactRingBuffer<Format>& buffer, int index) {
+    if constexpr (Format == LineFormat::Int16) {
+        const int32x4_t wide = vmovl_s16(vld1_s16(reinterpret_cast<const int16_t*>(buffer.data + index)));
+        return vmulq_n_f32(vcvtq_f32_s32(wide), 1.0f / INT16_SCALE);
+    } else {
+#if defined(__aarch64__)
+        return vcvt_f32_f16(vreinterpret_f16_u16(vld1_u16(buffer.data + index)));
+#else
+        const float taps[4] = {buffer.load(index), buffer.load(index + 1), buffer.load(index + 2), buffer.load(index + 3)};
+        return vld1q_f32(taps);
+#endif
+    }
+}
+
+template <class Line>
+inline float32x4_t peekCubicInterp4(const Line& buffer, float32x4_t phase) {
+    const int32x4_t intPart = vcvtq_s32_f32(phase);
+    const float32x4_t fracPart = vsubq_f32(phase, vcvtq_f32_s32(intPart));
+    
+    int index[4];
+    vst1q_s32(index, vandq_s32(vsubq_s32(intPart, vdupq_n_s32(1)), vdupq_n_s32(buffer.mask)));
+    
+    const float32x4x2_t t01 = vtrnq_f32(loadTaps4(buffer, index[0]), loadTaps4(buffer, index[1]));
+    const float32x4x2_t t23 = vtrnq_f32(loadTaps4(buffer, index[2]), loadTaps4(buffer, index[3]));
+    
+    const float32x4_t y0 = vcombine_f32(vget_low_f32(t01.val[0]), vget_low_f32(t23.val[0]));
+    const float32x4_t y1 = vcombine_f32(vget_low_f32(t01.val[1]), vget_low_f32(t23.val[1]));
+    const float32x4_t y2 = vcombine_f32(vget_high_f32(t01.val[0]), vget_high_f32(t23.val[0]));
+    const float32x4_t y3 = vcombine_f32(vget_high_f32(t01.val[1]), vget_high_f32(t23.val[1]));
+    
+    return cubicInterp4(fracPart, y0, y1, y2, y3);
+}
+
+#endif
+
+// accum[i] += peekCubicInterp(buffer, phases[i]) * window[i] for i in [0, numSamples)
+template <class Line>
+inline void accumulateCubicWindowed(const Line& buffer, const float* phases,
+                                    const float* window, float* accum, int numSamples) {
+    int i = 0;
+    
+#if defined(GRAINDELAY_SIMD_AVX)
+    for (; i + 8 <= numSamples; i += 8) {
+        const __m256 grainSample = peekCubicInterp8(buffer, _mm256_loadu_ps(phases + i));
+        _mm256_storeu_ps(accum + i, _mm256_add_ps(_mm256_loadu_ps(accum + i), _mm256_mul_ps(grainSample, _mm256_loadu_ps(window + i))));
+    }
+#endif
+#if defined(GRAINDELAY_SIMD_SSE)
+    for (; i + 4 <= numSamples; i += 4) {
+        const __m128 grainSample = peekCubicInterp4(buffer, _mm_loadu_ps(phases + i));
+        _mm_storeu_ps(accum + i, _mm_add_ps(_mm_loadu_ps(accum + i), _mm_mul_ps(grainSample, _mm_loadu_ps(window + i))));
+    }
+#elif defined(GRAINDELAY_SIMD_NEON)
+    for (; i + 4 <= numSamples; i += 4) {
+        const float32x4_t grainSample = peekCubicInterp4(buffer, vld1q_f32(phases + i));
+        vst1q_f32(accum + i, vaddq_f32(vld1q_f32(accum + i), vmulq_f32(grainSample, vld1q_f32(window + i))));
+    }
+#endif
+    
+    // Scalar fallback and remainder
+    for (; i < numSamples; ++i) {
+        accum[i] += peekCubicInterp(buffer, phases[i]) * window[i];
+    }
+}
+
+// Scalar version for buffers of arbitrary size, such as server Buffers
+inline void accumulateCubicWindowed(const float* buffer, int bufSize, const float* phases,
+                                    const float* window, float* accum, int numSamples) {
+    for (int i = 0; i < numSamples; ++i) {
+        accum[i] += peekCubicInterp(buffer, bufSize, phases[i]) * window[i];
+    }
+}
+
+// accum[i] += peekInterp<Mode>(buffer, phases[i]) * window[i], cubic reads take the SIMD kernel
+template <InterpMode Mode, class Line>
+inline void accumulateWindowed(const Line& buffer, const float* phases,
+                               const float* window, float* accum, int numSamples) {
+    if constexpr (Mode == InterpMode::Cubic) {
+        accumulateCubicWindowed(buffer, phases, window, accum, numSamples);
+    } else {
+        for (int i = 0; i < numSamples; ++i) {
+            accum[i] += peekInterp<Mode>(buffer, phases[i]) * window[i];
+        }
+    }
+}
+
+template <InterpMode Mode>
+inline void accumulateWindowed(const float* buffer, int bufSize, const float* phases,
+                               const float* window, float* accum, int numSamples) {
+    for (int i = 0; i < numSamples; ++i) {
+        accum[i] += peekInterp<Mode>(buffer, bufSize, phases[i]) * window[i];
+    }
+}
+
 // ===== ONE POLE FILTER UTILITIES =====
 
 struct OnePoleNormalized {
     float m_state = 0.0f;
+    float m_coeff = 0.0f;     // Cached, clipped coefficient
     
-    float processLowpass(float input, float coeff) {
-        coeff = sc_clip(coeff, 0.0f, 1.0f);
-        m_state = input * (1.0f - coeff) + m_state * coeff;
+    // Set once per block instead of clipping the coefficient every sample
+    void setCoefficient(float coeff) {
+        m_coeff = sc_clip(coeff, 0.0f, 1.0f);
+    }
+    
+    float processLowpass(float input) {
+        m_state = input * (1.0f - m_coeff) + m_state * m_coeff;
         return m_state;
     }
+    
+    float processLowpass(float input, float coeff) {
+        setCoefficient(coeff);
+        return processLowpass(input);
+    }
+
+    // Once per block: a decaying state would otherwise settle on a denormal
+    void flushDenormals() {
+        m_state = zapgremlins(m_state);
+    }
 
     void reset() {
         m_state = 0.0f;
@@ -61,169 +740,632 @@ struct OnePoleNormalized {
 struct OnePoleFilter {
     
     float m_state{0.0f};
-   
-    float processLowpass(float input, float cutoffHz, float sampleRate) {
+    
+    // Coefficient cache, only recomputed when cutoff or sample rate change
+    float m_coeff{0.0f};
+    float m_cutoffHz{0.0f};
+    float m_sampleRate{0.0f};
+    
+    void setCutoff(float cutoffHz, float sampleRate) {
+        if (cutoffHz == m_cutoffHz && sampleRate == m_sampleRate) {
+            return;
+        }
+        m_cutoffHz = cutoffHz;
+        m_sampleRate = sampleRate;
 
         // Clip slope to full Nyquist range, then take absolute value
         float slope = cutoffHz / sampleRate;
         float safeSlope = std::abs(sc_clip(slope, -0.5f, 0.5f));
         
         // Calculate coefficient: b = exp(-2π * slope)
-        float coeff = std::exp(-TWO_PI * safeSlope);
-        
+        m_coeff = std::exp(-TWO_PI * safeSlope);
+    }
+   
+    float processLowpass(float input) {
         // OnePole formula: y[n] = x[n] * (1-b) + y[n-1] * b
-        m_state = input * (1.0f - coeff) + m_state * coeff;
-        
+        m_state = input * (1.0f - m_coeff) + m_state * m_coeff;
         return m_state;
     }
    
-    float processHighpass(float input, float cutoffHz, float sampleRate) {
-        float lowpassed = processLowpass(input, cutoffHz, sampleRate);
+    float processHighpass(float input) {
+        float lowpassed = processLowpass(input);
         return input - lowpassed;
     }
+   
+    float processLowpass(float input, float cutoffHz, float sampleRate) {
+        setCutoff(cutoffHz, sampleRate);
+        return processLowpass(input);
+    }
+   
+    float processHighpass(float input, float cutoffHz, float sampleRate) {
+        setCutoff(cutoffHz, sampleRate);
+        return processHighpass(input);
+    }
 
+    // Once per block: a decaying state would otherwise settle on a denormal
+    void flushDenormals() {
+        m_state = zapgremlins(m_state);
+    }
+    
     void reset() {
         m_state = 0.0f;
     }
 };
 
-// ===== TRIGGER AND TIMING UTILITIES =====
+// ===== FEEDBACK LANES =====
+
+// One sample of the feedback write path of many delay lines at once. Lane k runs the
+// operations of GrainDelay::next for one sample: the compensated grain sum goes through
+// the damping lowpass (OnePoleNormalized), the dry input through the DC blocker
+// (OnePoleFilter::processHighpass), and their sum is the value written to the line.
+// All row arrays hold one value per lane, so consecutive lanes fill a SIMD register and
+// the filter recursions of different lanes run side by side.
+struct FeedbackLanes {
+    float compensation;   // Overlap compensation gain of this sample
+    float feedback;
+    float mix;
+    float dampCoeff;      // Damping lowpass coefficient, shared by all lanes
+    float dcCoeff;        // DC blocker lowpass coefficient
+    float* dampState;     // Filter states, one per lane
+    float* dcState;
+};
+
+inline float feedbackLane(const FeedbackLanes& p, int k, float dry, float wet, float& write) {
+    const float delayed = wet * p.compensation;
+    p.dampState[k] = delayed * (1.0f - p.dampCoeff) + p.dampState[k] * p.dampCoeff;
+    p.dcState[k] = dry * (1.0f - p.dcCoeff) + p.dcState[k] * p.dcCoeff;
+    write = zapgremlins((dry - p.dcState[k]) + p.dampState[k] * p.feedback);
+    return lerp(dry, delayed, p.mix);
+}
+
+#if defined(GRAINDELAY_SIMD_SSE)
+
+// zapgremlins() on four values, NaNs fail both compares
+inline __m128 zapgremlins4(__m128 x) {
+    const __m128 absx = _mm_andnot_ps(_mm_set1_ps(-0.0f), x);
+    const __m128 keep = _mm_and_ps(_mm_cmpgt_ps(absx, _mm_set1_ps(1e-15f)), _mm_cmplt_ps(absx, _mm_set1_ps(1e15f)));
+    return _mm_and_ps(x, keep);
+}
+
+#endif
+
+#if defined(GRAINDELAY_SIMD_AVX)
 
-struct RampToTrig {
-    double m_lastPhase{0.0};
-    bool m_lastWrap{false};
+inline __m256 zapgremlins8(__m256 x) {
+    const __m256 absx = _mm256_andnot_ps(_mm256_set1_ps(-0.0f), x);
+    const __m256 keep = _mm256_and_ps(_mm256_cmp_ps(absx, _mm256_set1_ps(1e-15f), _CMP_GT_OQ), _mm256_cmp_ps(absx, _mm256_set1_ps(1e15f), _CMP_LT_OQ));
+    return _mm256_and_ps(x, keep);
+}
+
+#endif
+
+// output[k] = dry/wet mix, write[k] = line value for k in [0, numLanes),
+// the vector paths keep the operation order of feedbackLane()
+inline void processFeedbackLanes(const FeedbackLanes& p, const float* dry, const float* wet,
+                                 float* output, float* write, int numLanes) {
+    int k = 0;
     
-    bool process(double currentPhase) {
-        // Detect wrap using current vs last phase
-        double delta = currentPhase - m_lastPhase;
-        double sum = currentPhase + m_lastPhase;
-        bool currentWrap = (sum != 0.0) && (std::abs(delta / sum) > 0.5);
+#if defined(GRAINDELAY_SIMD_AVX)
+    {
+        const __m256 compensation = _mm256_set1_ps(p.compensation);
+        const __m256 feedback = _mm256_set1_ps(p.feedback);
+        const __m256 mix = _mm256_set1_ps(p.mix);
+        const __m256 dampCoeff = _mm256_set1_ps(p.dampCoeff);
+        const __m256 dampGain = _mm256_set1_ps(1.0f - p.dampCoeff);
+        const __m256 dcCoeff = _mm256_set1_ps(p.dcCoeff);
+        const __m256 dcGain = _mm256_set1_ps(1.0f - p.dcCoeff);
         
-        // Edge detection - only trigger on rising edge of wrap
-        bool trigger = currentWrap && !m_lastWrap;
-        
-        // Update state for next sample
-        m_lastPhase = currentPhase;
-        m_lastWrap = currentWrap;
+        for (; k + 8 <= numLanes; k += 8) {
+            const __m256 x = _mm256_loadu_ps(dry + k);
+            const __m256 delayed = _mm256_mul_ps(_mm256_loadu_ps(wet + k), compensation);
+            const __m256 damp = _mm256_add_ps(_mm256_mul_ps(delayed, dampGain), _mm256_mul_ps(_mm256_loadu_ps(p.dampState + k), dampCoeff));
+            const __m256 dc = _mm256_add_ps(_mm256_mul_ps(x, dcGain), _mm256_mul_ps(_mm256_loadu_ps(p.dcState + k), dcCoeff));
+            _mm256_storeu_ps(p.dampState + k, damp);
+            _mm256_storeu_ps(p.dcState + k, dc);
+            _mm256_storeu_ps(write + k, zapgremlins8(_mm256_add_ps(_mm256_sub_ps(x, dc), _mm256_mul_ps(damp, feedback))));
+            _mm256_storeu_ps(output + k, _mm256_add_ps(x, _mm256_mul_ps(mix, _mm256_sub_ps(delayed, x))));
+        }
+    }
+#endif
+#if defined(GRAINDELAY_SIMD_SSE)
+    {
+        const __m128 compensation = _mm_set1_ps(p.compensation);
+        const __m128 feedback = _mm_set1_ps(p.feedback);
+        const __m128 mix = _mm_set1_ps(p.mix);
+        const __m128 dampCoeff = _mm_set1_ps(p.dampCoeff);
+        const __m128 dampGain = _mm_set1_ps(1.0f - p.dampCoeff);
+        const __m128 dcCoeff = _mm_set1_ps(p.dcCoeff);
+        const __m128 dcGain = _mm_set1_ps(1.0f - p.dcCoeff);
         
-        return trigger;
+        for (; k + 4 <= numLanes; k += 4) {
+            const __m128 x = _mm_loadu_ps(dry + k);
+            const __m128 delayed = _mm_mul_ps(_mm_loadu_ps(wet + k), compensation);
+            const __m128 damp = _mm_add_ps(_mm_mul_ps(delayed, dampGain), _mm_mul_ps(_mm_loadu_ps(p.dampState + k), dampCoeff));
+            const __m128 dc = _mm_add_ps(_mm_mul_ps(x, dcGain), _mm_mul_ps(_mm_loadu_ps(p.dcState + k), dcCoeff));
+            _mm_storeu_ps(p.dampState + k, damp);
+            _mm_storeu_ps(p.dcState + k, dc);
+            _mm_storeu_ps(write + k, zapgremlins4(_mm_add_ps(_mm_sub_ps(x, dc), _mm_mul_ps(damp, feedback))));
+            _mm_storeu_ps(output + k, _mm_add_ps(x, _mm_mul_ps(mix, _mm_sub_ps(delayed, x))));
+        }
     }
+#endif
     
-    void reset() {
-        m_lastPhase = 0.0;
-        m_lastWrap = false;
+    // Scalar fallback and remainder
+    for (; k < numLanes; ++k) {
+        output[k] = feedbackLane(p, k, dry[k], wet[k], write[k]);
     }
-};
+}
 
+// ===== TRIGGER AND TIMING UTILITIES =====
+
+// Precision of the grain window phases. Double by default; GRAINDELAY_FLOAT_PHASE
+// keeps them in float, computed from an anchor and an exact sample count instead of
+// accumulated, so rounding does not build up over a grain and twice as many grains
+// fit a SIMD register.
+#ifdef GRAINDELAY_FLOAT_PHASE
+using WindowPhase = float;
+#else
+using WindowPhase = double;
+#endif
+
+// Grain scheduler and timing state. Channels 0..NumChannels-1 are handed out by the
+// scheduler; NumExtraSlots further slots of the timing arrays are left to the owner,
+// which keeps the timing of voices the scheduler no longer tracks (fade tails) in
+// the same arrays and index space.
+template <int NumChannels, int NumExtraSlots = 0>
 struct EventSystem {
-    // Core timing components
-    RampToTrig trigDetect;
-   
-    // Ramp state
-    double phase{0.0};        // Current ramp position [0,1)
-    double slope{0.0};        // Current slope (rate/sampleRate)
-    bool wrapNext{false};     // Flag: will wrap on next sample
+    // Trigger ramp. A grain starts on the sample after the ramp reaches 1, whose
+    // subsample offset follows from the overshoot; the slope is latched there.
+    double phase{0.0};        // Ramp position of the next sample, wraps once it reaches 1
+    double slope{0.0};        // Latched slope (rate/sampleRate), 0 while at rest
+    bool startPending{false}; // A ramp that just left rest triggers on its second sample
    
-    // Dynamic channel state
-    std::vector<double> channelPhases;     
-    std::vector<double> channelSlopes;
-    std::vector<double> channelOffsets;
-    std::vector<bool> isActive;
-    std::vector<bool> justTriggered;
-    int numChannels;
-
-    explicit EventSystem(int channels = 5) : numChannels(channels) {
-        channelPhases.resize(numChannels, 0.0);
-        channelSlopes.resize(numChannels, 0.0);
-        channelOffsets.resize(numChannels, 0.0);
-        isActive.resize(numChannels, false);
-        justTriggered.resize(numChannels, false);
+    // Fixed-size channel state as aligned arrays, lives inside the owning unit
+    static constexpr int numChannels = NumChannels;
+    static constexpr int numSlots = NumChannels + NumExtraSlots;
+    alignas(64) std::array<WindowPhase, numSlots> channelPhases{};
+    alignas(64) std::array<WindowPhase, numSlots> channelSlopes{};
+    alignas(64) std::array<WindowPhase, numSlots> channelOffsets{};
+    
+#ifdef GRAINDELAY_FLOAT_PHASE
+    // Float phases: channelPhases = channelAnchors + channelElapsed * channelSlopes.
+    // The anchor moves up every REANCHOR_INTERVAL samples, which keeps the count exact.
+    static constexpr int REANCHOR_INTERVAL = 1 << 16;
+    alignas(64) std::array<float, numSlots> channelAnchors{};
+    alignas(64) std::array<int, numSlots> channelElapsed{};
+#endif
+    
+    // Voice bookkeeping: dense list of active channels and a stack of free ones,
+    // so per-sample cost scales with the number of active grains
+    std::array<int, NumChannels> activeChannels{};
+    std::array<int, NumChannels> freeChannels{};
+    int numActive{0};
+    int numFree{0};
+    
+    // Active channels in start order as a doubly linked list, so the oldest grain
+    // is found in constant time for voice stealing (-1 ends the list)
+    std::array<int, NumChannels> olderChannel{};
+    std::array<int, NumChannels> newerChannel{};
+    int oldestChannel{-1};
+    int newestChannel{-1};
+    
+    int triggeredChannel{-1}; // Channel started on this sample by process(), -1 if none
+    
+    // Subsample offset and slope of the last trigger reported by advance()
+    double triggerOffset{0.0};
+    double triggerSlope{0.0};
+    
+    EventSystem() {
+        reset();
+    }
+    
+    // Advance the trigger ramp by one sample, returns true if a grain starts on this sample
+    bool advance(float rate, float sampleRate) {
+        const ParamSignal constantRate{nullptr, rate, 0.0f, rate, rate};
+        return nextTrigger<ParamRates::Control>(constantRate, sampleRate, 0, 1) == 0;
+    }
+    
+    // Advance the trigger ramp from sample start up to and including the next trigger
+    // before end and return its sample, or through end - 1 and return end. Samples
+    // between triggers cost nothing, the rate is only read where the slope is latched.
+    template <ParamRates Rates>
+    int nextTrigger(const ParamSignal& rate, float sampleRate, int start, int end) {
+        int i = start;
+        
+        while (i < end) {
+            
+            // At rest (initial state, or a rate <= 0 at the last wrap) until the rate turns positive
+            if (slope <= 0.0) {
+                slope = rate.at<Rates>(i) / sampleRate;
+                
+                if (slope > 0.0) {
+                    phase = slope;
+                    startPending = true;
+                } else {
+                    slope = 0.0;
+                }
+                ++i;
+                continue;
+            }
+            
+            if (startPending) {
+                startPending = false;
+                latchTrigger();
+                phase += slope;
+                return i;
+            }
+            
+            // Samples until the ramp reaches 1, j = 0 when the last sample already got there
+            const int remaining = end - i;
+            const double distance = (1.0 - phase) / slope;
+            int j = distance <= 0.0 ? 0 : static_cast<int>(std::min(std::ceil(distance), static_cast<double>(remaining)));
+            
+            // Settle rounding so j is exactly the first sample with phase + j * slope >= 1
+            while (j > 0 && phase + (j - 1) * slope >= 1.0) {
+                --j;
+            }
+            while (j < remaining && phase + j * slope < 1.0) {
+                ++j;
+            }
+            
+            if (j == remaining) {
+                phase += remaining * slope;
+                return end;
+            }
+            
+            i += j;
+            phase = (phase + j * slope) - 1.0;
+            slope = rate.at<Rates>(i) / sampleRate;
+            
+            if (slope <= 0.0) {
+                phase = 0.0;
+                slope = 0.0;
+                ++i;
+                continue;
+            }
+            
+            latchTrigger();
+            phase += slope;
+            return i;
+        }
+        return end;
+    }
+    
+    // The onset of a grain triggered on this sample, phase is the wrapped ramp position
+    void latchTrigger() {
+        triggerSlope = slope;
+        triggerOffset = phase / slope;
+    }
+    
+    // Start a grain for the last trigger on a free channel, returns -1 and drops
+    // the grain if all channels are busy
+    int startChannel(float overlap) {
+        if (numFree == 0) {
+            return -1;
+        }
+        
+        const int ch = freeChannels[--numFree];
+        activeChannels[numActive++] = ch;
+        restartChannel(ch, overlap);
+        return ch;
+    }
+    
+    // Start the last trigger's grain on an active channel, which becomes the newest.
+    // Used for voice stealing, the channel keeps its place in activeChannels.
+    void restartChannel(int ch, float overlap) {
+        channelSlopes[ch] = static_cast<WindowPhase>(triggerSlope / overlap);
+        channelOffsets[ch] = static_cast<WindowPhase>(triggerOffset);
+        channelPhases[ch] = channelSlopes[ch] * channelOffsets[ch];
+#ifdef GRAINDELAY_FLOAT_PHASE
+        channelAnchors[ch] = channelPhases[ch];
+        channelElapsed[ch] = 0;
+#endif
+        
+        if (ch == newestChannel) {
+            return;
+        }
+        if (olderChannel[ch] != -1 || ch == oldestChannel) {
+            unlink(ch);
+        }
+        
+        olderChannel[ch] = newestChannel;
+        newerChannel[ch] = -1;
+        
+        if (newestChannel != -1) {
+            newerChannel[newestChannel] = ch;
+        } else {
+            oldestChannel = ch;
+        }
+        newestChannel = ch;
+    }
+    
+    // Advance the window phase of a channel or extra slot by a number of samples
+    void advanceChannel(int ch, int numSamples) {
+#ifdef GRAINDELAY_FLOAT_PHASE
+        channelElapsed[ch] += numSamples;
+        channelPhases[ch] = channelAnchors[ch] + static_cast<float>(channelElapsed[ch]) * channelSlopes[ch];
+        
+        if (channelElapsed[ch] >= REANCHOR_INTERVAL) {
+            channelAnchors[ch] = channelPhases[ch];
+            channelElapsed[ch] = 0;
+        }
+#else
+        channelPhases[ch] += channelSlopes[ch] * numSamples;
+#endif
+    }
+    
+    // Release activeChannels[index], the last active channel takes its place
+    void releaseActive(int index) {
+        const int ch = activeChannels[index];
+        unlink(ch);
+        freeChannels[numFree++] = ch;
+        activeChannels[index] = activeChannels[--numActive];
+    }
+    
+    // Remove a channel from the start order list
+    void unlink(int ch) {
+        const int older = olderChannel[ch];
+        const int newer = newerChannel[ch];
+        
+        if (older != -1) {
+            newerChannel[older] = newer;
+        } else {
+            oldestChannel = newer;
+        }
+        if (newer != -1) {
+            olderChannel[newer] = older;
+        } else {
+            newestChannel = older;
+        }
+        
+        olderChannel[ch] = -1;
+        newerChannel[ch] = -1;
     }
    
-    std::vector<float> process(float rate, bool resetTrigger, float overlap, float sampleRate) {
-        std::vector<float> output(numChannels, 0.0f);
+    // Per-sample reference path: advances the ramp and all active channels by one sample
+    // and writes the window phase of every active channel into output[channel], which
+    // is owned by the caller so nothing is allocated on the audio thread
+    void process(float rate, bool resetTrigger, float overlap, float sampleRate, float* output) {
         
         // Handle reset
         if (resetTrigger) {
             reset();
-            return output; // Early exit on reset
+            return; // Early exit on reset
         }
 
-        // Clear triggers for this cycle
-        std::fill(justTriggered.begin(), justTriggered.end(), false);
-       
-        // Initialize on first sample
-        if (slope == 0.0) {
-            slope = rate / sampleRate;
-        }
-       
-        // 1. Handle wrap from previous sample
-        if (wrapNext) {
-            phase -= 1.0;                       // Wrap the phase
-            slope = rate / sampleRate;          // Latch new slope for next period
-            wrapNext = false;
-        }
+        // Start a grain if the ramp wrapped
+        triggeredChannel = advance(rate, sampleRate) ? startChannel(overlap) : -1;
        
-        // 2. Detect trigger
-        bool trigger = trigDetect.process(phase);
-       
-        // 3. Handle trigger - find first available channel
-        if (trigger && slope != 0.0) {
-            for (int ch = 0; ch < numChannels; ++ch) {
-                if (!isActive[ch]) {
-                    // Found available channel - trigger grain
-                    justTriggered[ch] = true;
-                    channelSlopes[ch] = slope / overlap;
-                    channelOffsets[ch] = phase / slope;
-                    channelPhases[ch] = channelSlopes[ch] * channelOffsets[ch];
-                    isActive[ch] = true;
-                    break;
-                }
-            }
-        }
-       
-        // 4. Process channels
-        for (int ch = 0; ch < numChannels; ++ch) {
-            if (!isActive[ch]) {
-                output[ch] = 0.0f;
-                continue;
-            }
+        // Process active channels, swap-removing the ones that finished
+        int i = 0;
+        while (i < numActive) {
+            const int ch = activeChannels[i];
            
             // Don't increment on trigger sample
-            if (!justTriggered[ch]) {
-                channelPhases[ch] += channelSlopes[ch];
+            if (ch != triggeredChannel) {
+                advanceChannel(ch, 1);
             }
            
             if (channelPhases[ch] >= 1.0) {
-                isActive[ch] = false;
-                output[ch] = 0.0f;
+                releaseActive(i);
             } else {
                 output[ch] = static_cast<float>(channelPhases[ch]);
+                ++i;
             }
         }
-       
-        // 5. Update for next sample
-        phase += slope;
-       
-        // 6. Check for wrap
-        if (phase >= 1.0) {
-            wrapNext = true;
-        }
-       
-        return output;
     }
    
     void reset() {
         phase = 0.0;
         slope = 0.0;
-        wrapNext = false;
-        trigDetect.reset();
+        startPending = false;
         std::fill(channelPhases.begin(), channelPhases.end(), 0.0);
         std::fill(channelSlopes.begin(), channelSlopes.end(), 0.0);
         std::fill(channelOffsets.begin(), channelOffsets.end(), 0.0);
-        std::fill(isActive.begin(), isActive.end(), false);
-        std::fill(justTriggered.begin(), justTriggered.end(), false);
+#ifdef GRAINDELAY_FLOAT_PHASE
+        std::fill(channelAnchors.begin(), channelAnchors.end(), 0.0f);
+        std::fill(channelElapsed.begin(), channelElapsed.end(), 0);
+#endif
+        
+        std::fill(olderChannel.begin(), olderChannel.end(), -1);
+        std::fill(newerChannel.begin(), newerChannel.end(), -1);
+        oldestChannel = -1;
+        newestChannel = -1;
+        
+        // Fill the free stack so channel 0 is handed out first
+        numActive = 0;
+        numFree = NumChannels;
+        for (int ch = 0; ch < NumChannels; ++ch) {
+            freeChannels[ch] = NumChannels - 1 - ch;
+        }
+        triggeredChannel = -1;
+        triggerOffset = 0.0;
+        triggerSlope = 0.0;
+    }
+};
+
+// ===== GRAIN READS =====
+
+// Read positions and window gains of one grain, filled a chunk at a time for the
+// interpolation kernels. The window phase is that of the next sample. In double
+// precision it is accumulated, float phases are computed from the channel's anchor
+// so grain lengths stay subsample-accurate.
+struct GrainCursor {
+    const WindowTable& window;
+    const float readOffset;   // Delay line position at onset, samples
+    const float rate;
+    float phase;              // Samples read since onset
+    float fade;               // Fade-out gain of a stolen grain
+    const float fadeStep;
+    const WindowPhase windowSlope;
+#ifdef GRAINDELAY_FLOAT_PHASE
+    const float windowAnchor;
+    const int windowElapsed;
+#else
+    double windowPhase;
+#endif
+    int rendered = 0;         // Samples filled since construction
+    
+    template <class Events>
+    GrainCursor(const Events& events, int slot, const WindowTable& windowTable, float offset, float grainRate, float grainPhase, float grainFade = 1.0f, float grainFadeStep = 0.0f) :
+        window(windowTable),
+        readOffset(offset),
+        rate(grainRate),
+        phase(grainPhase),
+        fade(grainFade),
+        fadeStep(grainFadeStep),
+        windowSlope(events.channelSlopes[slot]),
+#ifdef GRAINDELAY_FLOAT_PHASE
+        windowAnchor(events.channelAnchors[slot]),
+        windowElapsed(events.channelElapsed[slot])
+#else
+        windowPhase(events.channelPhases[slot])
+#endif
+    {}
+    
+    // Fills up to count <= KERNEL_SIZE samples, fewer when the window ends or the
+    // fade reaches 0 first, and returns the number filled
+    static constexpr int KERNEL_SIZE = 64;
+    
+    int fill(float* phases, float* gains, int count) {
+        int n = 0;
+        
+#ifdef GRAINDELAY_FLOAT_PHASE
+        // No dependency between samples, so this loop vectorizes
+        float windowPhases[KERNEL_SIZE];
+        
+        for (int i = 0; i < count; ++i) {
+            windowPhases[i] = windowAnchor + static_cast<float>(windowElapsed + rendered + i) * windowSlope;
+        }
+#endif
+        
+        for (; n < count; ++n) {
+#ifdef GRAINDELAY_FLOAT_PHASE
+            const float windowPhase = windowPhases[n];
+#endif
+            
+            // The grain ends when its window phase reaches 1, or a stolen grain has faded out
+            if (windowPhase >= 1.0 || fade <= 0.0f) {
+                break;
+            }
+            
+            // Advance phase
+            phase += rate;
+            
+            phases[n] = readOffset + phase;
+            gains[n] = window.lookup(static_cast<float>(windowPhase)) * fade;
+#ifndef GRAINDELAY_FLOAT_PHASE
+            windowPhase += windowSlope;
+#endif
+            fade += fadeStep;
+        }
+        
+        rendered += n;
+        return n;
+    }
+    
+    // Stores the window phase back into the event system, the caller keeps phase and fade
+    template <class Events>
+    void store(Events& events, int slot) const {
+#ifdef GRAINDELAY_FLOAT_PHASE
+        events.advanceChannel(slot, rendered);
+#else
+        events.channelPhases[slot] = windowPhase;
+#endif
+    }
+};
+
+// ===== PROFILING =====
+
+// Per-block cycle counts of the sections of a calc function, compiled in with
+// GRAINDELAY_PROFILE. The counter is the TSC on x86, the virtual timer on ARM64 (a fixed
+// frequency, coarser than the CPU clock) and nanoseconds elsewhere. A section may run
+// several times per block, its ticks add up until endBlock() folds them into the
+// block statistics. Only the thread running the unit touches it: the server runs unit
+// commands between blocks, so reading the statistics needs no locking.
+#if defined(GRAINDELAY_PROFILE)
+inline uint64 readCycleCounter() {
+#if defined(_MSC_VER) && (defined(_M_X64) || defined(_M_IX86))
+    return __rdtsc();
+#elif defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#elif defined(__aarch64__)
+    uint64 value;
+    asm volatile("mrs %0, cntvct_el0" : "=r"(value));
+    return value;
+#else
+    return static_cast<uint64>(std::chrono::duration_cast<std::chrono::nanoseconds>(std::chrono::steady_clock::now().time_since_epoch()).count());
+#endif
+}
+
+struct Profile {
+    enum Sections {
+        Block,      // The whole calc function
+        Triggers,   // Trigger scheduling and grain starts
+        Grains,     // Grain reads and windowing
+        Feedback,   // Filters, delay line write and output mix
+        NumSections
+    };
+    
+    struct Section {
+        uint64 start = 0;
+        uint64 blockTicks = 0;    // Ticks of the current block
+        uint64 minTicks = std::numeric_limits<uint64>::max();
+        uint64 maxTicks = 0;
+        uint64 totalTicks = 0;
+    };
+    
+    std::array<Section, NumSections> sections{};
+    uint32 blocks = 0;
+    
+    void start(int section) {
+        sections[section].start = readCycleCounter();
+    }
+    
+    void stop(int section) {
+        sections[section].blockTicks += readCycleCounter() - sections[section].start;
+    }
+    
+    // Stops the Block section and adds this block to the statistics
+    void endBlock() {
+        stop(Block);
+        
+        for (Section& section : sections) {
+            section.minTicks = std::min(section.minTicks, section.blockTicks);
+            section.maxTicks = std::max(section.maxTicks, section.blockTicks);
+            section.totalTicks += section.blockTicks;
+            section.blockTicks = 0;
+        }
+        ++blocks;
+    }
+    
+    // Min, mean and max ticks per block of each section since the last clear
+    void report(float* values) const {
+        for (int s = 0; s < NumSections; ++s) {
+            const Section& section = sections[s];
+            values[3 * s] = blocks > 0 ? static_cast<float>(section.minTicks) : 0.0f;
+            values[3 * s + 1] = blocks > 0 ? static_cast<float>(section.totalTicks) / static_cast<float>(blocks) : 0.0f;
+            values[3 * s + 2] = static_cast<float>(section.maxTicks);
+        }
+    }
+    
+    void clear() {
+        for (Section& section : sections) {
+            section.minTicks = std::numeric_limits<uint64>::max();
+            section.maxTicks = 0;
+            section.totalTicks = 0;
+        }
+        blocks = 0;
     }
 };
 
+    #define GRAINDELAY_PROFILE_START(profile, section) (profile).start(Utils::Profile::section)
+    #define GRAINDELAY_PROFILE_STOP(profile, section) (profile).stop(Utils::Profile::section)
+    #define GRAINDELAY_PROFILE_END_BLOCK(profile) (profile).endBlock()
+#else
+    #define GRAINDELAY_PROFILE_START(profile, section) ((void)0)
+    #define GRAINDELAY_PROFILE_STOP(profile, section) ((void)0)
+    #define GRAINDELAY_PROFILE_END_BLOCK(profile) ((void)0)
+#endif
+
 } // namespace Utils
\ No newline at end of file